@@ -25,17 +25,283 @@
 #include "vlogger.h"
 
 #include <stdarg.h>
+#include <stddef.h>
+#include <limits.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+// AVX2 is used when the CPU supports it, regardless of the compiler flags
+#if defined(__GNUC__) && defined(__x86_64__)
+  #define VLOG_HEX_AVX2
+#endif
+
+#if defined(VLOG_HEX_AVX2) || defined(__SSE2__)
+  #include <immintrin.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+  #define MSG_NOSIGNAL 0
+#endif
 
 enum {
   kDateTimeBufferSize = 100,
-  kOutputBufferSize = 1024
+  kOutputBufferSize = 1024,
+  kQueueSize = 1024, // Must be a power of 2
+  kSocketBatchSize = 64,
+  kSocketBackoffMinMs = 50,
+  kSocketBackoffMaxMs = 5000,
+  kSocketSendTimeoutMs = 1000,
+  kSinkDrainMs = 2000,
+  kSyncIntervalMs = 1000,
+  kFrameHeaderSize = 16,
+  kFrameFlushMs = 500,
+  kCompressHashBits = 12,
+  kCompressMinMatch = 4,
+  kCompressMaxOffset = 65535,
+  kLayoutMaxOps = 32,
+  kLayoutMaxLiterals = 256,
+  kLayoutMaxWidth = 64,
+  kContextMaxDepth = 8,
+  kContextBufferSize = 256,
+  kHexdumpRowBytes = 16,
+  kHexdumpRowSize = 78 // "00000000  xx xx ... xx  xx ... xx  |................|"
+};
+
+/// Hex encoding kernels
+enum {
+  kHexScalar,
+  kHexSse2,
+  kHexAvx2
+};
+
+/// Layout operations, each one emits a literal segment or a field
+enum {
+  kOpLiteral,
+  kOpTimestamp,
+  kOpTimestampMs,
+  kOpPid,
+  kOpThread,
+  kOpLevel,
+  kOpContext,
+  kOpContextJson,
+  kOpMessage,
+  kOpMessageJson
 };
 
+/**
+ * A single layout operation, literals and the {ctx} suffix
+ * point into the layout pool
+ */
+typedef struct {
+  unsigned char type;
+  signed char width;
+  unsigned short offset;
+  unsigned short length;
+} vLogOp;
+
+/// A compiled line layout
+typedef struct {
+  vLogOp ops[kLayoutMaxOps];
+  size_t count;
+  char literals[kLayoutMaxLiterals];
+} vLogLayout;
+
+/**
+ * Per-thread context fields, kept pre-rendered both as text
+ * (req=abc tenant=t1) and as JSON members ("req":"abc","tenant":"t1",)
+ * and updated only on push and pop
+ */
+typedef struct {
+  size_t depth;
+  size_t textLength;
+  size_t jsonLength;
+  size_t textStack[kContextMaxDepth];
+  size_t jsonStack[kContextMaxDepth];
+  char text[kContextBufferSize];
+  char json[kContextBufferSize];
+} vLogContext;
+
+/// Message body writer, returns the number of bytes written
+typedef size_t (*vLogBody)(char *buffer, size_t size, void *data);
+
+/// State of a hexdump spanning one or more log entries
+typedef struct {
+  const char *label;
+  const unsigned char *data;
+  size_t length;
+  size_t offset;
+  int options;
+} vLogHexdumpBody;
+
+/// Arguments of a printf-style message body
+typedef struct {
+  const char *format;
+  va_list args;
+} vLogArguments;
+
+/// A formatted line waiting in a queue, with the durability policy
+/// the producer decided on
+typedef struct {
+  atomic_size_t sequence;
+  size_t length;
+  int level;
+  int policy;
+  char data[kOutputBufferSize];
+} vLogSlot;
+
+/**
+ * Bounded lock-free queue with many producers and one consumer
+ *
+ * Each slot carries a sequence number that tells producers and
+ * the consumer whose turn it is, so pushing a line needs only
+ * atomics and a write() and stays AS-Safe like the plain stream.
+ * The consumer sleeps on the wake pipe and producers write to it
+ * only when the consumer has announced it's sleeping.
+ *
+ * Producers are counted while they use an open queue, so closing
+ * it can wait for them before releasing the storage. The consumer
+ * publishes in committed how many lines it has delivered, and
+ * delivers the lines it buffers right away up to the position
+ * requested in flush.
+ */
+typedef struct {
+  vLogSlot *slots;
+  atomic_size_t head;
+  size_t tail;
+  int wake[2];
+  atomic_bool sleeping;
+  atomic_bool open;
+  atomic_int producers;
+  atomic_size_t committed;
+  atomic_size_t flush;
+  atomic_int waiters;
+  pthread_mutex_t lock;
+  pthread_cond_t progress;
+} vLogQueue;
+
+/// Socket sink state, owned by the sender thread once started
+typedef struct {
+  atomic_bool stopping;
+  int type;
+  int fd;
+  size_t offset;
+  struct sockaddr_storage address;
+  socklen_t addressLength;
+  vLogQueue queue;
+  pthread_t sender;
+} vLogSocketSink;
+
+/// Compressed file sink state, owned by the compressor thread once started
+typedef struct {
+  atomic_bool stopping;
+  int fd;
+  off_t size;
+  size_t used;
+  long long started;
+  bool periodic;
+  long long due;
+  unsigned char *frame;
+  unsigned char *output;
+  vLogQueue queue;
+  pthread_t compressor;
+} vLogCompressedSink;
+
+/**
+ * Durability state of the log stream
+ *
+ * Every line written at a level with a policy gets a sequence
+ * number. Writers that need their line on disk wait until the
+ * synced sequence covers it, while a single leader calls fdatasync
+ * for all the lines written so far (group commit).
+ */
+typedef struct {
+  atomic_int policies[LOG_FATAL / 10 + 1];
+  atomic_ullong written;
+  unsigned long long synced;
+  unsigned long long syncs;
+  bool syncing;
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+
+  // Periodic syncer, started and stopped under config
+  pthread_mutex_t config;
+  pthread_t syncer;
+  pthread_cond_t wake;
+  bool running;
+  bool stopping;
+  unsigned int interval;
+
+  // Preallocated space ahead of the write offset, extended by
+  // one caller at a time (the one that sets extending)
+  atomic_size_t preallocate;
+  atomic_llong offset;
+  atomic_llong allocated;
+  atomic_bool extending;
+} vLogDurability;
+
 int vLogLevel = LOG_DEFAULT;
 
+static vLogSocketSink vLogSocket = {.fd = -1};
+
+#ifndef VLOGGER_NO_COMPRESSION
+  static vLogCompressedSink vLogCompressed = {.fd = -1};
+#endif
+
+static vLogDurability vLogDurable = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .done = PTHREAD_COND_INITIALIZER,
+  .config = PTHREAD_MUTEX_INITIALIZER,
+  .wake = PTHREAD_COND_INITIALIZER,
+  .interval = kSyncIntervalMs
+};
+
+/// Compiled form of "{ts} | {pid:6} | {tid} | {lvl:-7} | {ctx: | }{msg}"
+static const vLogLayout vLogDefaultLayout = {
+  .ops = {
+    {.type = kOpTimestamp},
+    {.type = kOpLiteral, .length = 3},
+    {.type = kOpPid, .width = 6},
+    {.type = kOpLiteral, .length = 3},
+    {.type = kOpThread},
+    {.type = kOpLiteral, .length = 3},
+    {.type = kOpLevel, .width = -7},
+    {.type = kOpLiteral, .length = 3},
+    {.type = kOpContext, .length = 3},
+    {.type = kOpMessage}
+  },
+  .count = 10,
+  .literals = " | "
+};
+
+static vLogLayout vLogCustomLayout = {};
+
+static const vLogLayout *vLogActiveLayout = &vLogDefaultLayout;
+
+/// Level labels indexed by level / 10
+static const char *vLogLevelLabels[] = {
+  "", "TRACE", "DEBUG", "INFO", "WARNING", "ERROR", "FATAL"
+};
+
+static _Thread_local vLogContext vLogThreadContext = {};
+
+/// Hex encoding kernel in use, detected on first use
+static atomic_int vLogHexKernel = -1;
+
+/// Cached process id, reset in the child after a fork
+static atomic_int vLogPid = 0;
+
+static pthread_once_t vLogPidOnce = PTHREAD_ONCE_INIT;
+
 bool vLogInit(int level, const char* filepath) {
   if (level >= LOG_OFF && level <= LOG_FATAL) {
     vLogLevel = level;
@@ -49,60 +315,1990 @@ bool vLogInit(int level, const char* filepath) {
       // The STDERR is now broken, but errno contains the error code
       return false;
     }
+    // Preallocation refers to the previous file
+    atomic_store(&vLogDurable.preallocate, 0);
   }
   return true;
 }
 
-void vLogMessage(const char *label, const char *format, ...) {
-  va_list args;
-  va_start(args, format);
-
-  // Generate an ISO 8601 date/time string
-  // (e.g. 2022-04-07T16:09:33+0100)
-  char timestamp[kDateTimeBufferSize] = {};
-  time_t now = time(NULL);
-  struct tm lt = {};
-  int res = strftime(
-    timestamp,
-    sizeof(timestamp),
-    "%FT%T%z",
-    localtime_r(&now, &lt)
-  );
+/**
+ * Maps a level label back to its log level constant
+ */
+static int vLogLabelLevel(const char *label) {
+  switch (label[0]) {
+    case 'T': return LOG_TRACE;
+    case 'D': return LOG_DEBUG;
+    case 'W': return LOG_WARN;
+    case 'E': return LOG_ERROR;
+    case 'F': return LOG_FATAL;
+    default: return LOG_INFO;
+  }
+}
 
-  // Generate the first part of the message, by parsing
-  // timestamp, pid, thread, label and appending the
-  // raw format argument
-  char message[kOutputBufferSize] = {};
-  snprintf(
-    message,
-    sizeof(message),
-    "%s | %6d | %ld | %-7s | %s\n",
-    (res > 0 ? timestamp : ""),
-    getpid(),
-    (unsigned long) pthread_self(),
-    label,
-    format
+/**
+ * Returns the current monotonic time in milliseconds
+ */
+static long long vLogClockMs(void) {
+  struct timespec ts = {};
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool vLogQueueInit(vLogQueue *queue) {
+  queue->slots = calloc(kQueueSize, sizeof(vLogSlot));
+  if (queue->slots == NULL) {
+    return false;
+  }
+  if (pipe(queue->wake) < 0) {
+    free(queue->slots);
+    queue->slots = NULL;
+    return false;
+  }
+  for (int i = 0; i < 2; i++) {
+    fcntl(queue->wake[i], F_SETFL, O_NONBLOCK);
+    fcntl(queue->wake[i], F_SETFD, FD_CLOEXEC);
+  }
+  for (size_t i = 0; i < kQueueSize; i++) {
+    atomic_init(&queue->slots[i].sequence, i);
+  }
+  atomic_init(&queue->head, 0);
+  atomic_init(&queue->sleeping, false);
+  atomic_init(&queue->committed, 0);
+  atomic_init(&queue->flush, 0);
+  atomic_init(&queue->waiters, 0);
+  pthread_mutex_init(&queue->lock, NULL);
+  pthread_cond_init(&queue->progress, NULL);
+  queue->tail = 0;
+  return true;
+}
+
+static void vLogQueueFree(vLogQueue *queue) {
+  close(queue->wake[0]);
+  close(queue->wake[1]);
+  pthread_mutex_destroy(&queue->lock);
+  pthread_cond_destroy(&queue->progress);
+  free(queue->slots);
+  queue->slots = NULL;
+}
+
+/**
+ * Stops accepting lines and waits for the producers that are still
+ * using the queue, returns false if the queue was not open
+ */
+static bool vLogQueueClose(vLogQueue *queue) {
+  if (!atomic_exchange(&queue->open, false)) {
+    return false;
+  }
+  while (atomic_load(&queue->producers) > 0) {
+    sched_yield();
+  }
+  return true;
+}
+
+/**
+ * Enters the queue as a producer, returns false if it's not open
+ *
+ * The relaxed check keeps the shared counter untouched (and the
+ * stream path uncontended) while the sink is not active.
+ */
+static bool vLogQueueEnter(vLogQueue *queue) {
+  if (!atomic_load_explicit(&queue->open, memory_order_relaxed)) {
+    return false;
+  }
+  atomic_fetch_add(&queue->producers, 1);
+  if (atomic_load(&queue->open)) {
+    return true;
+  }
+  atomic_fetch_sub(&queue->producers, 1);
+  return false;
+}
+
+static void vLogQueueLeave(vLogQueue *queue) {
+  atomic_fetch_sub(&queue->producers, 1);
+}
+
+/**
+ * Copies a line into the queue and returns the position that
+ * commits it, or 0 if the queue is full and the line was dropped
+ */
+static size_t vLogQueuePush(vLogQueue *queue, int level, int policy, const char *line, size_t length) {
+  size_t pos = atomic_load_explicit(&queue->head, memory_order_relaxed);
+  vLogSlot *slot = NULL;
+  for (;;) {
+    slot = &queue->slots[pos & (kQueueSize - 1)];
+    size_t seq = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+    ptrdiff_t diff = (ptrdiff_t)seq - (ptrdiff_t)pos;
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(
+        &queue->head, &pos, pos + 1,
+        memory_order_relaxed, memory_order_relaxed
+      )) {
+        break;
+      }
+    } else if (diff < 0) {
+      return 0;
+    } else {
+      pos = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    }
+  }
+  if (length > sizeof(slot->data)) {
+    length = sizeof(slot->data);
+  }
+  memcpy(slot->data, line, length);
+  slot->length = length;
+  slot->level = level;
+  slot->policy = policy;
+  atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+
+  // Pairs with the fence in vLogQueueWait, so either the consumer
+  // sees the new line or we see it's going to sleep
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_exchange(&queue->sleeping, false)) {
+    write(queue->wake[1], "", 1);
+  }
+  return pos + 1;
+}
+
+/**
+ * Returns the number of consecutive lines ready to be consumed,
+ * up to max; they stay in the queue until released
+ */
+static size_t vLogQueuePeek(vLogQueue *queue, vLogSlot **lines, size_t max) {
+  size_t count = 0;
+  while (count < max) {
+    size_t pos = queue->tail + count;
+    vLogSlot *slot = &queue->slots[pos & (kQueueSize - 1)];
+    if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != pos + 1) {
+      break;
+    }
+    lines[count++] = slot;
+  }
+  return count;
+}
+
+/**
+ * Gives the first count peeked slots back to the producers
+ */
+static void vLogQueueRelease(vLogQueue *queue, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    size_t pos = queue->tail++;
+    atomic_store_explicit(
+      &queue->slots[pos & (kQueueSize - 1)].sequence,
+      pos + kQueueSize,
+      memory_order_release
+    );
+  }
+}
+
+/**
+ * Waits for new lines (if wakeOnPush is set), an explicit wake
+ * up or the timeout to expire
+ */
+static void vLogQueueWait(vLogQueue *queue, int timeoutMs, bool wakeOnPush) {
+  vLogSlot *next = NULL;
+  if (wakeOnPush) {
+    atomic_store(&queue->sleeping, true);
+    atomic_thread_fence(memory_order_seq_cst);
+  }
+  if (!wakeOnPush || vLogQueuePeek(queue, &next, 1) == 0) {
+    struct pollfd pfd = {.fd = queue->wake[0], .events = POLLIN};
+    poll(&pfd, 1, timeoutMs);
+  }
+  atomic_store(&queue->sleeping, false);
+  char drain[64];
+  while (read(queue->wake[0], drain, sizeof(drain)) > 0) {}
+}
+
+static void vLogQueueWakeUp(vLogQueue *queue) {
+  write(queue->wake[1], "", 1);
+}
+
+/**
+ * Publishes the number of lines the consumer has delivered
+ * and wakes up whoever is waiting for them
+ */
+static void vLogQueueCommit(vLogQueue *queue) {
+  atomic_store(&queue->committed, queue->tail);
+  if (atomic_load(&queue->waiters) > 0) {
+    pthread_mutex_lock(&queue->lock);
+    pthread_cond_broadcast(&queue->progress);
+    pthread_mutex_unlock(&queue->lock);
+  }
+}
+
+/**
+ * Waits until the consumer has delivered the lines before position
+ * or the deadline (CLOCK_REALTIME, NULL for none) expires
+ */
+static bool vLogQueueWaitCommit(vLogQueue *queue, size_t position, const struct timespec *deadline) {
+  pthread_mutex_lock(&queue->lock);
+  atomic_fetch_add(&queue->waiters, 1);
+  while (atomic_load(&queue->committed) < position) {
+    if (deadline == NULL) {
+      pthread_cond_wait(&queue->progress, &queue->lock);
+    } else if (pthread_cond_timedwait(&queue->progress, &queue->lock, deadline) != 0) {
+      break;
+    }
+  }
+  atomic_fetch_sub(&queue->waiters, 1);
+  bool committed = atomic_load(&queue->committed) >= position;
+  pthread_mutex_unlock(&queue->lock);
+  return committed;
+}
+
+/**
+ * Returns the CLOCK_REALTIME time the given milliseconds from now
+ */
+static struct timespec vLogDeadline(long long milliseconds) {
+  struct timespec deadline = {};
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += milliseconds / 1000;
+  deadline.tv_nsec += (milliseconds % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+  return deadline;
+}
+
+/**
+ * Waits (up to kSinkDrainMs) for the lines queued so far to be
+ * delivered, without stopping the consumer or releasing anything
+ */
+static void vLogQueueDrain(vLogQueue *queue) {
+  if (!vLogQueueEnter(queue)) {
+    return;
+  }
+  size_t position = atomic_load(&queue->head);
+  atomic_store(&queue->flush, position);
+  vLogQueueWakeUp(queue);
+  struct timespec deadline = vLogDeadline(kSinkDrainMs);
+  vLogQueueWaitCommit(queue, position, &deadline);
+  vLogQueueLeave(queue);
+}
+
+/**
+ * Opens a new connection to the collector, returns false on failure
+ */
+static bool vLogSocketConnect(vLogSocketSink *sink) {
+  int fd = socket(
+    sink->address.ss_family,
+    (sink->type == LOG_SOCKET_TCP ? SOCK_STREAM : SOCK_DGRAM),
+    0
   );
+  if (fd < 0) {
+    return false;
+  }
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+  // Bounds connect and send, so a stalled collector can't block
+  // the sender (and vLogCloseSocket) forever
+  struct timeval timeout = {
+    .tv_sec = kSocketSendTimeoutMs / 1000,
+    .tv_usec = (kSocketSendTimeoutMs % 1000) * 1000
+  };
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  #ifdef SO_NOSIGPIPE
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+  #endif
+  if (connect(fd, (struct sockaddr *)&sink->address, sink->addressLength) < 0) {
+    close(fd);
+    return false;
+  }
+  sink->fd = fd;
+  sink->offset = 0;
+  return true;
+}
+
+static void vLogSocketDisconnect(vLogSocketSink *sink) {
+  close(sink->fd);
+  sink->fd = -1;
+}
+
+/// Syslog PRI prefixes (facility user) indexed by level / 10
+static const char *vLogSyslogPriority[] = {
+  "<15>", "<15>", "<15>", "<14>", "<12>", "<11>", "<10>"
+};
+
+/**
+ * Sends a batch of lines as syslog datagrams, one line per datagram,
+ * returns the number of lines sent or -1 on error
+ */
+static ssize_t vLogSocketSendDatagrams(vLogSocketSink *sink, vLogSlot **lines, size_t count) {
+  struct iovec iov[kSocketBatchSize][2];
+  for (size_t i = 0; i < count; i++) {
+    const char *priority = vLogSyslogPriority[lines[i]->level / 10];
+    size_t length = lines[i]->length;
+    if (length > 0 && lines[i]->data[length - 1] == '\n') {
+      length--;
+    }
+    iov[i][0] = (struct iovec){.iov_base = (void *)priority, .iov_len = strlen(priority)};
+    iov[i][1] = (struct iovec){.iov_base = lines[i]->data, .iov_len = length};
+  }
+
+  #ifdef LINUX
+    struct mmsghdr messages[kSocketBatchSize] = {};
+    for (size_t i = 0; i < count; i++) {
+      messages[i].msg_hdr.msg_iov = iov[i];
+      messages[i].msg_hdr.msg_iovlen = 2;
+    }
+    return sendmmsg(sink->fd, messages, count, MSG_NOSIGNAL);
+  #else
+    size_t sent = 0;
+    for (; sent < count; sent++) {
+      struct msghdr message = {.msg_iov = iov[sent], .msg_iovlen = 2};
+      if (sendmsg(sink->fd, &message, MSG_NOSIGNAL) < 0) {
+        return (sent > 0) ? (ssize_t)sent : -1;
+      }
+    }
+    return sent;
+  #endif
+}
+
+/**
+ * Sends a batch of lines over a stream with a single gathered write,
+ * returns the number of complete lines sent or -1 on error
+ *
+ * A partially sent line is remembered in sink->offset and completed
+ * by the next call.
+ */
+static ssize_t vLogSocketSendStream(vLogSocketSink *sink, vLogSlot **lines, size_t count) {
+  struct iovec iov[kSocketBatchSize];
+  for (size_t i = 0; i < count; i++) {
+    size_t skip = (i == 0) ? sink->offset : 0;
+    iov[i] = (struct iovec){
+      .iov_base = lines[i]->data + skip,
+      .iov_len = lines[i]->length - skip
+    };
+  }
+  struct msghdr message = {.msg_iov = iov, .msg_iovlen = count};
+  ssize_t written = sendmsg(sink->fd, &message, MSG_NOSIGNAL);
+  if (written < 0) {
+    return -1;
+  }
+
+  size_t sent = 0;
+  while (sent < count && (size_t)written >= iov[sent].iov_len) {
+    written -= iov[sent].iov_len;
+    sent++;
+  }
+  sink->offset = (sent < count) ? (size_t)written + (sent == 0 ? sink->offset : 0) : 0;
+  return sent;
+}
+
+/**
+ * Sleeps for the given backoff time, unless the sink is stopping
+ */
+static void vLogSocketBackoff(vLogSocketSink *sink, int delayMs) {
+  long long deadline = vLogClockMs() + delayMs;
+  long long left = delayMs;
+  while (!atomic_load(&sink->stopping) && left > 0) {
+    vLogQueueWait(&sink->queue, left, false);
+    left = deadline - vLogClockMs();
+  }
+}
+
+/**
+ * Sender thread: ships queued lines in batches and
+ * keeps the connection to the collector alive
+ */
+static void *vLogSocketRun(void *data) {
+  vLogSocketSink *sink = data;
+  vLogSlot *lines[kSocketBatchSize];
+  int backoff = kSocketBackoffMinMs;
+
+  for (;;) {
+    bool stopping = atomic_load(&sink->stopping);
+
+    if (sink->fd < 0 && !vLogSocketConnect(sink)) {
+      if (stopping) {
+        break;
+      }
+      vLogSocketBackoff(sink, backoff);
+      backoff = (backoff * 2 > kSocketBackoffMaxMs) ? kSocketBackoffMaxMs : backoff * 2;
+      continue;
+    }
+
+    size_t count = vLogQueuePeek(&sink->queue, lines, kSocketBatchSize);
+    if (count == 0) {
+      if (stopping) {
+        break;
+      }
+      vLogQueueWait(&sink->queue, -1, true);
+      continue;
+    }
+
+    ssize_t sent = (sink->type == LOG_SOCKET_TCP)
+      ? vLogSocketSendStream(sink, lines, count)
+      : vLogSocketSendDatagrams(sink, lines, count);
+    if (sent < 0) {
+      // Unsent lines stay queued for the next connection, which
+      // backs off too in case the collector keeps dropping us
+      vLogSocketDisconnect(sink);
+      if (stopping) {
+        break;
+      }
+      vLogSocketBackoff(sink, backoff);
+      backoff = (backoff * 2 > kSocketBackoffMaxMs) ? kSocketBackoffMaxMs : backoff * 2;
+      continue;
+    }
+    backoff = kSocketBackoffMinMs;
+    vLogQueueRelease(&sink->queue, sent);
+    vLogQueueCommit(&sink->queue);
+  }
+
+  if (sink->fd >= 0) {
+    vLogSocketDisconnect(sink);
+  }
+  return NULL;
+}
+
+/**
+ * Resolves the collector address, "path" for UNIX or "host:port" for TCP
+ */
+static bool vLogSocketResolve(vLogSocketSink *sink, int type, const char *address) {
+  memset(&sink->address, 0, sizeof(sink->address));
+  if (type == LOG_SOCKET_UNIX) {
+    struct sockaddr_un *local = (struct sockaddr_un *)&sink->address;
+    if (strlen(address) >= sizeof(local->sun_path)) {
+      errno = ENAMETOOLONG;
+      return false;
+    }
+    local->sun_family = AF_UNIX;
+    strcpy(local->sun_path, address);
+    sink->addressLength = sizeof(struct sockaddr_un);
+    return true;
+  }
+
+  const char *separator = strrchr(address, ':');
+  if (separator == NULL || separator == address || separator[1] == '\0') {
+    errno = EINVAL;
+    return false;
+  }
+  char host[256] = {};
+  size_t hostLength = separator - address;
+  if (hostLength >= sizeof(host)) {
+    errno = ENAMETOOLONG;
+    return false;
+  }
+  memcpy(host, address, hostLength);
+
+  struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+  struct addrinfo *result = NULL;
+  if (getaddrinfo(host, separator + 1, &hints, &result) != 0 || result == NULL) {
+    errno = EADDRNOTAVAIL;
+    return false;
+  }
+  memcpy(&sink->address, result->ai_addr, result->ai_addrlen);
+  sink->addressLength = result->ai_addrlen;
+  freeaddrinfo(result);
+  return true;
+}
+
+/**
+ * Delivers the lines still queued in the sinks when the program
+ * exits, e.g. the line of a Fatal
+ */
+static void vLogDrainSinks(void) {
+  vLogQueueDrain(&vLogSocket.queue);
+  #ifndef VLOGGER_NO_COMPRESSION
+    vLogQueueDrain(&vLogCompressed.queue);
+  #endif
+}
+
+/**
+ * The child of a fork has no sink threads, so its lines go back
+ * to the log stream; sinks can be started again in the child
+ */
+static void vLogForkSinks(void) {
+  atomic_store(&vLogSocket.queue.open, false);
+  atomic_store(&vLogSocket.queue.producers, 0);
+  #ifndef VLOGGER_NO_COMPRESSION
+    atomic_store(&vLogCompressed.queue.open, false);
+    atomic_store(&vLogCompressed.queue.producers, 0);
+  #endif
+}
+
+static void vLogRegisterDrain(void) {
+  atexit(vLogDrainSinks);
+  pthread_atfork(NULL, NULL, vLogForkSinks);
+}
+
+static pthread_once_t vLogDrainOnce = PTHREAD_ONCE_INIT;
+
+bool vLogInitSocket(int type, const char *address) {
+  if ((type != LOG_SOCKET_UNIX && type != LOG_SOCKET_TCP) || address == NULL) {
+    errno = EINVAL;
+    return false;
+  }
+  vLogCloseSocket();
+
+  vLogSocketSink *sink = &vLogSocket;
+  if (!vLogSocketResolve(sink, type, address) || !vLogQueueInit(&sink->queue)) {
+    return false;
+  }
+  sink->type = type;
+  sink->fd = -1;
+  atomic_store(&sink->stopping, false);
+
+  int res = pthread_create(&sink->sender, NULL, vLogSocketRun, sink);
+  if (res != 0) {
+    vLogQueueFree(&sink->queue);
+    errno = res;
+    return false;
+  }
+  pthread_once(&vLogDrainOnce, vLogRegisterDrain);
+  atomic_store(&sink->queue.open, true);
+  return true;
+}
+
+void vLogCloseSocket(void) {
+  vLogSocketSink *sink = &vLogSocket;
+  if (!vLogQueueClose(&sink->queue)) {
+    return;
+  }
+  atomic_store(&sink->stopping, true);
+  vLogQueueWakeUp(&sink->queue);
+  pthread_join(sink->sender, NULL);
+  vLogQueueFree(&sink->queue);
+}
+
+/**
+ * Returns the durability policy of a level, FATAL lines are
+ * always on disk (or sent) before the program exits
+ */
+static int vLogLevelPolicy(int level) {
+  if (level == LOG_FATAL) {
+    return LOG_DURABLE_SYNC;
+  }
+  return atomic_load_explicit(&vLogDurable.policies[level / 10], memory_order_relaxed);
+}
+
+#ifndef VLOGGER_NO_COMPRESSION
+/// Worst case size of a compressed block
+#define vLogCompressBound(length) ((length) + (length) / 255 + 16)
+
+static unsigned int vLogRead32(const unsigned char *data) {
+  return data[0] | data[1] << 8 | data[2] << 16 | (unsigned int)data[3] << 24;
+}
+
+static void vLogWrite32(unsigned char *data, unsigned int value) {
+  data[0] = value;
+  data[1] = value >> 8;
+  data[2] = value >> 16;
+  data[3] = value >> 24;
+}
+
+/**
+ * FNV-1a checksum of a frame content
+ */
+static unsigned int vLogChecksum(const unsigned char *data, size_t length) {
+  unsigned int hash = 2166136261u;
+  for (size_t i = 0; i < length; i++) {
+    hash = (hash ^ data[i]) * 16777619u;
+  }
+  return hash;
+}
+
+/**
+ * Writes an LZ4-style length extension (a run of 255 and the remainder)
+ */
+static unsigned char *vLogCompressLength(unsigned char *output, size_t length) {
+  for (; length >= 255; length -= 255) {
+    *output++ = 255;
+  }
+  *output++ = length;
+  return output;
+}
+
+/**
+ * Writes a sequence: a token with the literal and match lengths,
+ * the literals and, unless it's the last one, the match offset
+ */
+static unsigned char *vLogCompressSequence(
+  unsigned char *output,
+  const unsigned char *literals, size_t literalLength,
+  size_t offset, size_t matchLength
+) {
+  unsigned char *token = output++;
+  size_t match = (matchLength > 0) ? matchLength - kCompressMinMatch : 0;
+  *token = ((literalLength < 15 ? literalLength : 15) << 4) | (match < 15 ? match : 15);
+  if (literalLength >= 15) {
+    output = vLogCompressLength(output, literalLength - 15);
+  }
+  memcpy(output, literals, literalLength);
+  output += literalLength;
+  if (matchLength > 0) {
+    *output++ = offset;
+    *output++ = offset >> 8;
+    if (match >= 15) {
+      output = vLogCompressLength(output, match - 15);
+    }
+  }
+  return output;
+}
+
+/**
+ * Compresses a block with a greedy LZ77 matcher using the LZ4 block
+ * layout, returns the compressed size
+ *
+ * The output buffer must hold vLogCompressBound(length) bytes.
+ */
+static size_t vLogCompress(unsigned char *output, const unsigned char *input, size_t length) {
+  unsigned int table[1 << kCompressHashBits] = {};
+  unsigned char *cursor = output;
+  size_t anchor = 0;
+  size_t position = 0;
+
+  // Matches never start in the last 12 bytes nor cover the last 5
+  size_t limit = (length > 12) ? length - 12 : 0;
+  while (position < limit) {
+    unsigned int sequence = vLogRead32(input + position);
+    unsigned int hash = (sequence * 2654435761u) >> (32 - kCompressHashBits);
+    size_t candidate = table[hash];
+    table[hash] = position;
+
+    if (candidate < position && position - candidate <= kCompressMaxOffset &&
+      vLogRead32(input + candidate) == sequence) {
+      size_t match = kCompressMinMatch;
+      while (position + match < length - 5 && input[candidate + match] == input[position + match]) {
+        match++;
+      }
+      cursor = vLogCompressSequence(
+        cursor, input + anchor, position - anchor, position - candidate, match
+      );
+      position += match;
+      anchor = position;
+    } else {
+      // Skip faster through data that doesn't compress
+      position += 1 + ((position - anchor) >> 6);
+    }
+  }
+
+  cursor = vLogCompressSequence(cursor, input + anchor, length - anchor, 0, 0);
+  return cursor - output;
+}
+
+/**
+ * Reads an LZ4-style length extension, returns false if truncated
+ */
+static bool vLogDecompressLength(const unsigned char *input, size_t length, size_t *position, size_t *value) {
+  unsigned char byte = 255;
+  while (byte == 255) {
+    if (*position >= length) {
+      return false;
+    }
+    byte = input[(*position)++];
+    *value += byte;
+  }
+  return true;
+}
+
+/**
+ * Decompresses a block, returns the decompressed size or -1
+ * if the block is corrupted or doesn't fit in the output buffer
+ */
+static long vLogDecompress(unsigned char *output, size_t size, const unsigned char *input, size_t length) {
+  size_t position = 0;
+  size_t written = 0;
+  while (position < length) {
+    unsigned char token = input[position++];
+    size_t literals = token >> 4;
+    if (literals == 15 && !vLogDecompressLength(input, length, &position, &literals)) {
+      return -1;
+    }
+    if (literals > length - position || literals > size - written) {
+      return -1;
+    }
+    memcpy(output + written, input + position, literals);
+    position += literals;
+    written += literals;
+
+    // The last sequence has no match
+    if (position == length) {
+      break;
+    }
+    if (length - position < 2) {
+      return -1;
+    }
+    size_t offset = input[position] | input[position + 1] << 8;
+    position += 2;
+    size_t match = token & 0x0f;
+    if (match == 15 && !vLogDecompressLength(input, length, &position, &match)) {
+      return -1;
+    }
+    match += kCompressMinMatch;
+    if (offset == 0 || offset > written || match > size - written) {
+      return -1;
+    }
+    // Byte by byte, the match can overlap its own output
+    for (size_t i = 0; i < match; i++, written++) {
+      output[written] = output[written - offset];
+    }
+  }
+  return written;
+}
+
+/**
+ * Compresses the pending lines into a frame and appends it to the file
+ *
+ * Frames can be decoded on their own, so a crash loses at most the
+ * frame being written. A frame that can't be written completely is
+ * cut off the file, and the lines in it are lost.
+ */
+static void vLogCompressedFlush(vLogCompressedSink *sink) {
+  if (sink->used == 0) {
+    return;
+  }
+  unsigned char *payload = sink->output + kFrameHeaderSize;
+  size_t payloadLength = vLogCompress(payload, sink->frame, sink->used);
+  if (payloadLength >= sink->used) {
+    // Stored as is, readers tell by the equal lengths
+    payload = sink->frame;
+    payloadLength = sink->used;
+  }
+
+  unsigned char header[kFrameHeaderSize] = {'v', 'L', 'Z', '1'};
+  vLogWrite32(header + 4, sink->used);
+  vLogWrite32(header + 8, payloadLength);
+  vLogWrite32(header + 12, vLogChecksum(sink->frame, sink->used));
+  struct iovec iov[2] = {
+    {.iov_base = header, .iov_len = kFrameHeaderSize},
+    {.iov_base = payload, .iov_len = payloadLength}
+  };
+  struct iovec *pending = iov;
+  int count = 2;
+  while (count > 0) {
+    ssize_t written = writev(sink->fd, pending, count);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      break;
+    }
+    // Skip what was written and retry with the rest
+    for (; count > 0 && (size_t)written >= pending->iov_len; pending++, count--) {
+      written -= pending->iov_len;
+    }
+    if (count > 0) {
+      pending->iov_base = (unsigned char *)pending->iov_base + written;
+      pending->iov_len -= written;
+    }
+  }
+
+  if (count == 0) {
+    sink->size += kFrameHeaderSize + payloadLength;
+  } else {
+    // Don't leave a partial frame in front of the next ones
+    ftruncate(sink->fd, sink->size);
+  }
+  sink->used = 0;
+}
+
+/**
+ * Writes the pending frame, syncs the file and commits the lines
+ * released so far to the producers waiting for them
+ */
+static void vLogCompressedSync(vLogCompressedSink *sink) {
+  vLogCompressedFlush(sink);
+  // Errors can't be fixed by retrying, the waiters are released anyway
+  fdatasync(sink->fd);
+  sink->periodic = false;
+  vLogQueueCommit(&sink->queue);
+}
+
+/**
+ * Compressor thread: collects the queued lines into frames and
+ * flushes them when full or kFrameFlushMs after their first line
+ *
+ * Synced lines flush the frame and sync the file right away, one
+ * sync for the whole batch, and so does a drain once every line
+ * it asked for is in the frame; periodic lines are synced at
+ * most a sync interval after the first of them.
+ */
+static void *vLogCompressedRun(void *data) {
+  vLogCompressedSink *sink = data;
+  vLogSlot *lines[kSocketBatchSize];
+
+  for (;;) {
+    bool stopping = atomic_load(&sink->stopping);
+    bool sync = false;
+    size_t count = vLogQueuePeek(&sink->queue, lines, kSocketBatchSize);
+    for (size_t i = 0; i < count; i++) {
+      if (sink->used + lines[i]->length > LOG_FRAME_SIZE) {
+        vLogCompressedFlush(sink);
+      }
+      if (sink->used == 0) {
+        sink->started = vLogClockMs();
+      }
+      memcpy(sink->frame + sink->used, lines[i]->data, lines[i]->length);
+      sink->used += lines[i]->length;
+
+      int policy = lines[i]->policy;
+      sync |= (policy == LOG_DURABLE_SYNC);
+      if (policy == LOG_DURABLE_PERIODIC && !sink->periodic) {
+        pthread_mutex_lock(&vLogDurable.lock);
+        sink->due = vLogClockMs() + vLogDurable.interval;
+        pthread_mutex_unlock(&vLogDurable.lock);
+        sink->periodic = true;
+      }
+    }
+    vLogQueueRelease(&sink->queue, count);
+
+    // A drain waits for every line queued before it
+    size_t requested = atomic_load(&sink->queue.flush);
+    sync |= (requested > atomic_load(&sink->queue.committed) && sink->queue.tail >= requested);
+
+    long long now = vLogClockMs();
+    if (sync || (sink->periodic && now >= sink->due)) {
+      vLogCompressedSync(sink);
+    }
+    if (count > 0) {
+      continue;
+    }
+    if (stopping) {
+      break;
+    }
+
+    // Sleep until the frame or the periodic sync are due
+    long long left = -1;
+    if (sink->used > 0) {
+      left = sink->started + kFrameFlushMs - now;
+      if (left <= 0) {
+        vLogCompressedFlush(sink);
+        continue;
+      }
+    }
+    if (sink->periodic && (left < 0 || sink->due - now < left)) {
+      left = sink->due - now;
+    }
+    vLogQueueWait(&sink->queue, (left > INT_MAX) ? INT_MAX : left, true);
+  }
+
+  vLogCompressedSync(sink);
+  return NULL;
+}
+
+bool vLogInitCompressed(const char *filepath) {
+  if (filepath == NULL) {
+    errno = EINVAL;
+    return false;
+  }
+  vLogCloseCompressed();
+
+  vLogCompressedSink *sink = &vLogCompressed;
+  sink->fd = open(filepath, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+  if (sink->fd < 0) {
+    return false;
+  }
+  sink->size = lseek(sink->fd, 0, SEEK_END);
+  sink->frame = malloc(LOG_FRAME_SIZE);
+  sink->output = malloc(kFrameHeaderSize + vLogCompressBound(LOG_FRAME_SIZE));
+  if (sink->frame == NULL || sink->output == NULL || !vLogQueueInit(&sink->queue)) {
+    free(sink->frame);
+    free(sink->output);
+    close(sink->fd);
+    sink->fd = -1;
+    errno = ENOMEM;
+    return false;
+  }
+  sink->used = 0;
+  sink->periodic = false;
+  atomic_store(&sink->stopping, false);
+
+  int res = pthread_create(&sink->compressor, NULL, vLogCompressedRun, sink);
+  if (res != 0) {
+    vLogQueueFree(&sink->queue);
+    free(sink->frame);
+    free(sink->output);
+    close(sink->fd);
+    sink->fd = -1;
+    errno = res;
+    return false;
+  }
+  pthread_once(&vLogDrainOnce, vLogRegisterDrain);
+  atomic_store(&sink->queue.open, true);
+  return true;
+}
+
+void vLogCloseCompressed(void) {
+  vLogCompressedSink *sink = &vLogCompressed;
+  if (!vLogQueueClose(&sink->queue)) {
+    return;
+  }
+  atomic_store(&sink->stopping, true);
+  vLogQueueWakeUp(&sink->queue);
+  pthread_join(sink->compressor, NULL);
+  vLogQueueFree(&sink->queue);
+  free(sink->frame);
+  free(sink->output);
+  sink->frame = NULL;
+  sink->output = NULL;
+  close(sink->fd);
+  sink->fd = -1;
+}
+
+/**
+ * Moves the stream to the next frame magic after a corrupted frame
+ * that started at offset, or to the end if there are no more frames
+ */
+static void vLogSkipFrame(FILE *stream, long offset) {
+  if (offset < 0 || fseek(stream, offset + 1, SEEK_SET) < 0) {
+    return;
+  }
+  static const char magic[] = "vLZ1";
+  size_t matched = 0;
+  int c = 0;
+  while (matched < 4 && (c = getc(stream)) != EOF) {
+    if (c == magic[matched]) {
+      matched++;
+    } else {
+      // The magic has no repeated prefix, so only its first byte can restart it
+      matched = (c == magic[0]);
+    }
+  }
+  if (matched == 4) {
+    fseek(stream, -4, SEEK_CUR);
+  }
+}
+
+long vLogReadFrame(FILE *stream, char *buffer, size_t size) {
+  unsigned char header[kFrameHeaderSize] = {};
+  long offset = ftell(stream);
+  size_t headerLength = fread(header, 1, sizeof(header), stream);
+  if (headerLength == 0 && feof(stream)) {
+    return 0;
+  }
+  size_t rawLength = vLogRead32(header + 4);
+  size_t payloadLength = vLogRead32(header + 8);
+  if (headerLength < sizeof(header) || memcmp(header, "vLZ1", 4) != 0 ||
+    rawLength > LOG_FRAME_SIZE || payloadLength > vLogCompressBound(rawLength)) {
+    vLogSkipFrame(stream, offset);
+    errno = EBADMSG;
+    return -1;
+  }
+  if (rawLength > size) {
+    // Leave the frame there for a larger buffer
+    fseek(stream, offset, SEEK_SET);
+    errno = ENOBUFS;
+    return -1;
+  }
+
+  long length = -1;
+  if (payloadLength == rawLength) {
+    length = (fread(buffer, 1, rawLength, stream) == rawLength) ? (long)rawLength : -1;
+  } else {
+    unsigned char *payload = malloc(payloadLength);
+    if (payload == NULL) {
+      fseek(stream, offset, SEEK_SET);
+      errno = ENOMEM;
+      return -1;
+    }
+    if (fread(payload, 1, payloadLength, stream) == payloadLength) {
+      length = vLogDecompress((unsigned char *)buffer, rawLength, payload, payloadLength);
+    }
+    free(payload);
+  }
+
+  if (length != (long)rawLength ||
+    vLogChecksum((unsigned char *)buffer, rawLength) != vLogRead32(header + 12)) {
+    vLogSkipFrame(stream, offset);
+    errno = EBADMSG;
+    return -1;
+  }
+  return length;
+}
+#else
+bool vLogInitCompressed(const char *filepath) {
+  (void)filepath;
+  errno = ENOTSUP;
+  return false;
+}
+
+void vLogCloseCompressed(void) {}
+
+long vLogReadFrame(FILE *stream, char *buffer, size_t size) {
+  (void)stream;
+  (void)buffer;
+  (void)size;
+  errno = ENOTSUP;
+  return -1;
+}
+#endif
+
+/**
+ * Flushes the log stream data to disk
+ */
+static void vLogSyncStream(void) {
+  #ifdef MACOS
+    if (fcntl(STDERR_FILENO, F_FULLFSYNC) < 0) {
+      fsync(STDERR_FILENO);
+    }
+  #else
+    fdatasync(STDERR_FILENO);
+  #endif
+}
+
+/**
+ * Waits until the line with the given sequence number is on disk
+ *
+ * The first writer to arrive becomes the leader and syncs every line
+ * written so far, the others wait for it and return straight away
+ * if their line was covered, so one sync serves a whole group.
+ */
+static void vLogCommit(unsigned long long sequence) {
+  vLogDurability *durable = &vLogDurable;
+  pthread_mutex_lock(&durable->lock);
+  while (durable->synced < sequence) {
+    if (durable->syncing) {
+      pthread_cond_wait(&durable->done, &durable->lock);
+      continue;
+    }
+    unsigned long long target = atomic_load(&durable->written);
+    durable->syncing = true;
+    pthread_mutex_unlock(&durable->lock);
+
+    // Errors (e.g. on a terminal or a pipe) can't be fixed by retrying
+    vLogSyncStream();
+
+    pthread_mutex_lock(&durable->lock);
+    durable->syncing = false;
+    durable->syncs++;
+    if (target > durable->synced) {
+      durable->synced = target;
+    }
+    pthread_cond_broadcast(&durable->done);
+  }
+  pthread_mutex_unlock(&durable->lock);
+}
+
+/**
+ * Periodic syncer thread: commits the pending lines every interval
+ */
+static void *vLogSyncerRun(void *data) {
+  vLogDurability *durable = data;
+  pthread_mutex_lock(&durable->lock);
+  while (!durable->stopping) {
+    struct timespec deadline = vLogDeadline(durable->interval);
+    pthread_cond_timedwait(&durable->wake, &durable->lock, &deadline);
+
+    unsigned long long target = atomic_load(&durable->written);
+    if (!durable->stopping && target > durable->synced) {
+      pthread_mutex_unlock(&durable->lock);
+      vLogCommit(target);
+      pthread_mutex_lock(&durable->lock);
+    }
+  }
+  pthread_mutex_unlock(&durable->lock);
+  return NULL;
+}
+
+bool vLogSetDurability(int level, int policy) {
+  // FATAL lines are always synced
+  if (level < LOG_TRACE || level > LOG_FATAL || level % 10 != 0 ||
+    policy < LOG_DURABLE_NONE || policy > LOG_DURABLE_SYNC ||
+    (level == LOG_FATAL && policy != LOG_DURABLE_SYNC)) {
+    errno = EINVAL;
+    return false;
+  }
+  vLogDurability *durable = &vLogDurable;
+  pthread_mutex_lock(&durable->config);
+  atomic_store(&durable->policies[level / 10], policy);
+  bool periodic = false;
+  for (int i = LOG_TRACE / 10; i <= LOG_FATAL / 10; i++) {
+    periodic |= (atomic_load(&durable->policies[i]) == LOG_DURABLE_PERIODIC);
+  }
+
+  // Start or stop the periodic syncer as needed, the config lock
+  // keeps other calls out until the old syncer has been joined
+  bool started = true;
+  if (periodic && !durable->running) {
+    pthread_mutex_lock(&durable->lock);
+    durable->stopping = false;
+    pthread_mutex_unlock(&durable->lock);
+    int res = pthread_create(&durable->syncer, NULL, vLogSyncerRun, durable);
+    if (res != 0) {
+      errno = res;
+      started = false;
+    }
+    durable->running = started;
+  } else if (!periodic && durable->running) {
+    pthread_mutex_lock(&durable->lock);
+    durable->stopping = true;
+    pthread_cond_signal(&durable->wake);
+    pthread_mutex_unlock(&durable->lock);
+    pthread_join(durable->syncer, NULL);
+    durable->running = false;
+  }
+  pthread_mutex_unlock(&durable->config);
+  return started;
+}
+
+bool vLogSetSyncInterval(unsigned int milliseconds) {
+  if (milliseconds == 0) {
+    errno = EINVAL;
+    return false;
+  }
+  pthread_mutex_lock(&vLogDurable.lock);
+  vLogDurable.interval = milliseconds;
+  pthread_cond_signal(&vLogDurable.wake);
+  pthread_mutex_unlock(&vLogDurable.lock);
+  return true;
+}
+
+/**
+ * Reserves the next chunk of disk space when the write offset
+ * gets past the preallocated area
+ *
+ * Only one caller extends at a time, the others go on without
+ * waiting (their blocks are allocated by the write as usual),
+ * so lines stay AS-Safe.
+ */
+static void vLogExtend(long long end) {
+  #ifdef LINUX
+    vLogDurability *durable = &vLogDurable;
+    if (atomic_exchange(&durable->extending, true)) {
+      return;
+    }
+    size_t chunk = atomic_load(&durable->preallocate);
+    long long allocated = atomic_load(&durable->allocated);
+    while (chunk > 0 && end > allocated) {
+      if (fallocate(STDERR_FILENO, FALLOC_FL_KEEP_SIZE, allocated, chunk) < 0) {
+        atomic_store(&durable->preallocate, 0);
+        break;
+      }
+      allocated += chunk;
+      atomic_store(&durable->allocated, allocated);
+    }
+    atomic_store(&durable->extending, false);
+  #else
+    (void)end;
+  #endif
+}
+
+bool vLogPreallocate(size_t size) {
+  #ifdef LINUX
+    vLogDurability *durable = &vLogDurable;
+    struct stat info = {};
+    if (size == 0 || fstat(STDERR_FILENO, &info) < 0 || !S_ISREG(info.st_mode)) {
+      errno = (size == 0) ? EINVAL : ENOTSUP;
+      return false;
+    }
+    if (fallocate(STDERR_FILENO, FALLOC_FL_KEEP_SIZE, info.st_size, size) < 0) {
+      return false;
+    }
+    while (atomic_exchange(&durable->extending, true)) {
+      sched_yield();
+    }
+    atomic_store(&durable->offset, info.st_size);
+    atomic_store(&durable->allocated, info.st_size + size);
+    atomic_store(&durable->preallocate, size);
+    atomic_store(&durable->extending, false);
+    return true;
+  #else
+    (void)size;
+    errno = ENOTSUP;
+    return false;
+  #endif
+}
+
+/**
+ * Sends a formatted line to the active destination
+ */
+static void vLogOutput(int level, const char *line, size_t length) {
+  int policy = vLogLevelPolicy(level);
+
+  // Synced lines wait until the sender has handed them to the collector,
+  // for a bounded time as it may be unreachable
+  if (vLogQueueEnter(&vLogSocket.queue)) {
+    size_t position = vLogQueuePush(&vLogSocket.queue, level, policy, line, length);
+    if (position > 0 && policy == LOG_DURABLE_SYNC) {
+      struct timespec deadline = vLogDeadline(kSinkDrainMs);
+      vLogQueueWaitCommit(&vLogSocket.queue, position, &deadline);
+    }
+    vLogQueueLeave(&vLogSocket.queue);
+    return;
+  }
+
+  #ifndef VLOGGER_NO_COMPRESSION
+    // Synced lines wait until their frame is written and on disk
+    if (vLogQueueEnter(&vLogCompressed.queue)) {
+      size_t position = vLogQueuePush(&vLogCompressed.queue, level, policy, line, length);
+      if (position > 0 && policy == LOG_DURABLE_SYNC) {
+        vLogQueueWaitCommit(&vLogCompressed.queue, position, NULL);
+      }
+      vLogQueueLeave(&vLogCompressed.queue);
+      return;
+    }
+  #endif
+
+  // Safely write to stream
+  write(STDERR_FILENO, line, length);
+
+  if (atomic_load_explicit(&vLogDurable.preallocate, memory_order_relaxed) > 0) {
+    long long end = atomic_fetch_add(&vLogDurable.offset, length) + length;
+    if (end > atomic_load_explicit(&vLogDurable.allocated, memory_order_relaxed)) {
+      vLogExtend(end);
+    }
+  }
+
+  if (policy != LOG_DURABLE_NONE) {
+    unsigned long long sequence = atomic_fetch_add(&vLogDurable.written, 1) + 1;
+    if (policy == LOG_DURABLE_SYNC) {
+      vLogCommit(sequence);
+    }
+  }
+}
+
+/**
+ * Escapes a character for a JSON string and returns the
+ * length of the escaped sequence, at most 6 bytes
+ */
+static size_t vLogEscapeJson(char *escaped, unsigned char c) {
+  static const char digits[] = "0123456789abcdef";
+  if (c == '"' || c == '\\') {
+    escaped[0] = '\\';
+    escaped[1] = c;
+    return 2;
+  }
+  if (c < 0x20) {
+    memcpy(escaped, "\\u00", 4);
+    escaped[4] = digits[c >> 4];
+    escaped[5] = digits[c & 0x0f];
+    return 6;
+  }
+  escaped[0] = c;
+  return 1;
+}
+
+/**
+ * Appends a string to a context buffer, escaping it for JSON if
+ * needed; returns false if it doesn't fit
+ */
+static bool vLogContextAppend(char *buffer, size_t *length, const char *text, bool json) {
+  size_t cursor = *length;
+  for (const unsigned char *c = (const unsigned char *)text; *c != '\0'; c++) {
+    char escaped[6] = {(char)*c};
+    size_t size = json ? vLogEscapeJson(escaped, *c) : 1;
+    if (cursor + size > kContextBufferSize) {
+      return false;
+    }
+    memcpy(buffer + cursor, escaped, size);
+    cursor += size;
+  }
+  *length = cursor;
+  return true;
+}
+
+bool vLogContextPush(const char *key, const char *value) {
+  vLogContext *context = &vLogThreadContext;
+  if (key == NULL || value == NULL || context->depth == kContextMaxDepth) {
+    errno = (key == NULL || value == NULL) ? EINVAL : ENOBUFS;
+    return false;
+  }
+
+  size_t textLength = context->textLength;
+  size_t jsonLength = context->jsonLength;
+  bool fits = (textLength == 0 || vLogContextAppend(context->text, &textLength, " ", false))
+    && vLogContextAppend(context->text, &textLength, key, false)
+    && vLogContextAppend(context->text, &textLength, "=", false)
+    && vLogContextAppend(context->text, &textLength, value, false)
+    && vLogContextAppend(context->json, &jsonLength, "\"", false)
+    && vLogContextAppend(context->json, &jsonLength, key, true)
+    && vLogContextAppend(context->json, &jsonLength, "\":\"", false)
+    && vLogContextAppend(context->json, &jsonLength, value, true)
+    && vLogContextAppend(context->json, &jsonLength, "\",", false);
+  if (!fits) {
+    errno = ENOBUFS;
+    return false;
+  }
+
+  context->textStack[context->depth] = context->textLength;
+  context->jsonStack[context->depth] = context->jsonLength;
+  context->depth++;
+  context->textLength = textLength;
+  context->jsonLength = jsonLength;
+  return true;
+}
+
+void vLogContextPop(void) {
+  vLogContext *context = &vLogThreadContext;
+  if (context->depth > 0) {
+    context->depth--;
+    context->textLength = context->textStack[context->depth];
+    context->jsonLength = context->jsonStack[context->depth];
+  }
+}
+
+void vLogContextClear(void) {
+  vLogContext *context = &vLogThreadContext;
+  context->depth = 0;
+  context->textLength = 0;
+  context->jsonLength = 0;
+}
+
+/**
+ * Parses a field name and its optional argument into an operation,
+ * the {ctx} suffix is copied into the layout pool
+ */
+static bool vLogCompileField(vLogLayout *layout, size_t *pool, vLogOp *op, const char *name, size_t length, const char *arg) {
+  // Fields with a named argument
+  if (length == 2 && strncmp(name, "ts", 2) == 0) {
+    if (arg == NULL) {
+      op->type = kOpTimestamp;
+    } else if (strncmp(arg, "ms}", 3) == 0) {
+      op->type = kOpTimestampMs;
+    } else {
+      return false;
+    }
+    return true;
+  }
+  if (length == 3 && strncmp(name, "ctx", 3) == 0) {
+    if (arg != NULL && strncmp(arg, "json}", 5) == 0) {
+      op->type = kOpContextJson;
+      return true;
+    }
+    // Any other argument is a suffix written only after a non empty context
+    op->type = kOpContext;
+    if (arg != NULL) {
+      size_t suffix = strchr(arg, '}') - arg;
+      if (*pool + suffix > kLayoutMaxLiterals) {
+        return false;
+      }
+      memcpy(layout->literals + *pool, arg, suffix);
+      op->offset = *pool;
+      op->length = suffix;
+      *pool += suffix;
+    }
+    return true;
+  }
+  if (length == 3 && strncmp(name, "msg", 3) == 0) {
+    if (arg == NULL) {
+      op->type = kOpMessage;
+    } else if (strncmp(arg, "json}", 5) == 0) {
+      op->type = kOpMessageJson;
+    } else {
+      return false;
+    }
+    return true;
+  }
+
+  // Fields with an optional width
+  long width = 0;
+  if (arg != NULL) {
+    char *end = NULL;
+    width = strtol(arg, &end, 10);
+    if (end == arg || *end != '}' || width < -kLayoutMaxWidth || width > kLayoutMaxWidth) {
+      return false;
+    }
+  }
+  op->width = width;
+
+  if (length == 3 && strncmp(name, "pid", 3) == 0) {
+    op->type = kOpPid;
+  } else if (length == 3 && strncmp(name, "tid", 3) == 0) {
+    op->type = kOpThread;
+  } else if (length == 3 && strncmp(name, "lvl", 3) == 0) {
+    op->type = kOpLevel;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Compiles a layout pattern into a list of operations, adjacent
+ * literal characters are merged into a single segment
+ */
+static bool vLogCompileLayout(vLogLayout *layout, const char *pattern) {
+  memset(layout, 0, sizeof(*layout));
+  size_t pool = 0;
+  int messages = 0;
+  vLogOp *literal = NULL;
+
+  for (const char *c = pattern; *c != '\0'; c++) {
+    if (*c == '{' && c[1] != '{') {
+      const char *close = strchr(c, '}');
+      if (close == NULL || layout->count == kLayoutMaxOps) {
+        return false;
+      }
+      const char *arg = memchr(c, ':', close - c);
+      size_t length = ((arg != NULL) ? arg : close) - (c + 1);
+      vLogOp *op = &layout->ops[layout->count++];
+      if (!vLogCompileField(layout, &pool, op, c + 1, length, (arg != NULL) ? arg + 1 : NULL)) {
+        return false;
+      }
+      messages += (op->type == kOpMessage || op->type == kOpMessageJson);
+      literal = NULL;
+      c = close;
+      continue;
+    }
+
+    // Literal character, "{{" and "}}" are escaped braces
+    if ((*c == '{' || *c == '}') && c[1] == *c) {
+      c++;
+    } else if (*c == '}') {
+      return false;
+    }
+    if (pool == kLayoutMaxLiterals) {
+      return false;
+    }
+    if (literal == NULL) {
+      if (layout->count == kLayoutMaxOps) {
+        return false;
+      }
+      literal = &layout->ops[layout->count++];
+      literal->type = kOpLiteral;
+      literal->offset = pool;
+    }
+    layout->literals[pool++] = *c;
+    literal->length++;
+  }
+  return messages == 1;
+}
+
+bool vLogSetLayout(const char *pattern) {
+  if (pattern == NULL) {
+    vLogActiveLayout = &vLogDefaultLayout;
+    return true;
+  }
+  vLogLayout layout;
+  if (!vLogCompileLayout(&layout, pattern)) {
+    errno = EINVAL;
+    return false;
+  }
+  vLogCustomLayout = layout;
+  vLogActiveLayout = &vLogCustomLayout;
+  return true;
+}
+
+static void vLogResetPid(void) {
+  atomic_store(&vLogPid, 0);
+}
+
+static void vLogRegisterFork(void) {
+  pthread_atfork(NULL, NULL, vLogResetPid);
+}
+
+/**
+ * Writes the decimal representation of value at the end of buffer,
+ * returns a pointer to the first digit
+ */
+static char *vLogFormatUnsigned(char *end, unsigned long value) {
+  do {
+    *--end = '0' + value % 10;
+    value /= 10;
+  } while (value > 0);
+  return end;
+}
+
+/**
+ * Copies a field value to the cursor, padding it to the given width
+ * (right aligned when positive, left aligned when negative)
+ */
+static char *vLogEmit(char *cursor, char *end, const char *text, size_t length, int width) {
+  size_t padding = 0;
+  size_t absWidth = (width < 0) ? -width : width;
+  if (absWidth > length) {
+    padding = absWidth - length;
+  }
+  if (width > 0) {
+    for (; padding > 0 && cursor < end; padding--) {
+      *cursor++ = ' ';
+    }
+  }
+  if (length > (size_t)(end - cursor)) {
+    length = end - cursor;
+  }
+  memcpy(cursor, text, length);
+  cursor += length;
+  for (; padding > 0 && cursor < end; padding--) {
+    *cursor++ = ' ';
+  }
+  return cursor;
+}
+
+/**
+ * Emits an ISO 8601 local date/time (e.g. 2022-04-07T16:09:33+0100),
+ * optionally with milliseconds (2022-04-07T16:09:33.123+0100)
+ *
+ * The formatted date/time and UTC offset are cached per thread
+ * and only rebuilt when the second changes.
+ */
+static char *vLogEmitTimestamp(char *cursor, char *end, bool milliseconds) {
+  static _Thread_local struct {
+    time_t second;
+    size_t length;
+    char datetime[kDateTimeBufferSize];
+    char zone[8];
+  } cache = {.second = -1};
+
+  struct timespec now = {};
+  clock_gettime(CLOCK_REALTIME, &now);
+  if (now.tv_sec != cache.second) {
+    struct tm lt = {};
+    localtime_r(&now.tv_sec, &lt);
+    cache.length = strftime(cache.datetime, sizeof(cache.datetime), "%FT%T", &lt);
+    if (strftime(cache.zone, sizeof(cache.zone), "%z", &lt) == 0) {
+      cache.zone[0] = '\0';
+    }
+    cache.second = now.tv_sec;
+  }
+
+  cursor = vLogEmit(cursor, end, cache.datetime, cache.length, 0);
+  if (milliseconds) {
+    char digits[4] = {'.'};
+    long ms = now.tv_nsec / 1000000;
+    digits[1] = '0' + ms / 100;
+    digits[2] = '0' + ms / 10 % 10;
+    digits[3] = '0' + ms % 10;
+    cursor = vLogEmit(cursor, end, digits, sizeof(digits), 0);
+  }
+  return vLogEmit(cursor, end, cache.zone, strlen(cache.zone), 0);
+}
+
+/**
+ * Formats a log line by running the active layout operations,
+ * the line is always terminated by a newline
+ *
+ * Fields that are not in the layout are never computed.
+ */
+static size_t vLogFormat(char *buffer, size_t size, const char *label, vLogBody body, void *data) {
+  const vLogLayout *layout = vLogActiveLayout;
+  char *cursor = buffer;
+  char *end = buffer + size - 1;
+  char digits[24];
+  char *digitsEnd = digits + sizeof(digits);
+
+  for (size_t i = 0; i < layout->count; i++) {
+    const vLogOp *op = &layout->ops[i];
+    switch (op->type) {
+      case kOpLiteral:
+        cursor = vLogEmit(cursor, end, layout->literals + op->offset, op->length, 0);
+        break;
+      case kOpTimestamp:
+      case kOpTimestampMs:
+        cursor = vLogEmitTimestamp(cursor, end, op->type == kOpTimestampMs);
+        break;
+      case kOpPid: {
+        int pid = atomic_load_explicit(&vLogPid, memory_order_relaxed);
+        if (pid == 0) {
+          pthread_once(&vLogPidOnce, vLogRegisterFork);
+          pid = getpid();
+          atomic_store_explicit(&vLogPid, pid, memory_order_relaxed);
+        }
+        char *first = vLogFormatUnsigned(digitsEnd, pid);
+        cursor = vLogEmit(cursor, end, first, digitsEnd - first, op->width);
+        break;
+      }
+      case kOpThread: {
+        char *first = vLogFormatUnsigned(digitsEnd, (unsigned long)pthread_self());
+        cursor = vLogEmit(cursor, end, first, digitsEnd - first, op->width);
+        break;
+      }
+      case kOpLevel:
+        cursor = vLogEmit(cursor, end, label, strlen(label), op->width);
+        break;
+      case kOpContext:
+        // The suffix is written only after a non empty context
+        if (vLogThreadContext.textLength > 0) {
+          cursor = vLogEmit(cursor, end, vLogThreadContext.text, vLogThreadContext.textLength, 0);
+          cursor = vLogEmit(cursor, end, layout->literals + op->offset, op->length, 0);
+        }
+        break;
+      case kOpContextJson:
+        cursor = vLogEmit(cursor, end, vLogThreadContext.json, vLogThreadContext.jsonLength, 0);
+        break;
+      case kOpMessage:
+        cursor += body(cursor, end - cursor + 1, data);
+        break;
+      case kOpMessageJson: {
+        // Render the message aside, then escape it into the line;
+        // a quarter of the room is kept for the escapes, so that
+        // hexdump rows (one newline and a few quotes each) are not
+        // consumed without being written
+        char message[kOutputBufferSize];
+        size_t available = (end - cursor) * 3 / 4 + 1;
+        size_t length = body(message, (available < sizeof(message)) ? available : sizeof(message), data);
+        char escaped[6];
+        for (size_t c = 0; c < length; c++) {
+          size_t size = vLogEscapeJson(escaped, message[c]);
+          if (cursor + size > end) {
+            break;
+          }
+          memcpy(cursor, escaped, size);
+          cursor += size;
+        }
+        break;
+      }
+    }
+  }
+
+  *cursor++ = '\n';
+  return cursor - buffer;
+}
+
+/**
+ * Message body writer for printf-style arguments
+ */
+static size_t vLogFormatArguments(char *buffer, size_t size, void *data) {
+  vLogArguments *message = data;
+  int length = vsnprintf(buffer, size, message->format, message->args);
+  if (length < 0) {
+    return 0;
+  }
+  return ((size_t)length < size) ? (size_t)length : size - 1;
+}
+
+void vLogMessage(const char *label, const char *format, ...) {
+  vLogArguments message = {.format = format};
+  va_start(message.args, format);
+
+  // Run the layout operations, the message itself
+  // is formatted straight into the output buffer
+  char output[kOutputBufferSize];
+  size_t length = vLogFormat(
+    output,
+    sizeof(output),
+    label,
+    vLogFormatArguments,
+    &message
+  );
+
+  va_end(message.args);
+
+  vLogOutput(vLogLabelLevel(label), output, length);
+}
+
+/**
+ * Returns the best hex kernel this CPU supports, detected once
+ */
+static int vLogHexKernelSupported(void) {
+  #ifdef VLOG_HEX_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      return kHexAvx2;
+    }
+  #endif
+  #ifdef __SSE2__
+    return kHexSse2;
+  #else
+    return kHexScalar;
+  #endif
+}
+
+static int vLogHexKernelActive(void) {
+  int kernel = atomic_load_explicit(&vLogHexKernel, memory_order_relaxed);
+  if (kernel < 0) {
+    kernel = vLogHexKernelSupported();
+    atomic_store_explicit(&vLogHexKernel, kernel, memory_order_relaxed);
+  }
+  return kernel;
+}
+
+static void vLogHexEncodeScalar(char *output, const unsigned char *input, size_t length) {
+  static const char digits[] = "0123456789abcdef";
+  for (size_t i = 0; i < length; i++) {
+    output[2 * i] = digits[input[i] >> 4];
+    output[2 * i + 1] = digits[input[i] & 0x0f];
+  }
+}
+
+#ifdef __SSE2__
+/**
+ * SSE2 kernel, 16 bytes per round: each byte is split into its
+ * nibbles, which are turned into digits with a compare and two
+ * adds, and then interleaved
+ */
+static void vLogHexEncodeSse2(char *output, const unsigned char *input, size_t length) {
+  const __m128i mask = _mm_set1_epi8(0x0f);
+  const __m128i nine = _mm_set1_epi8(9);
+  const __m128i zero = _mm_set1_epi8('0');
+  const __m128i alpha = _mm_set1_epi8('a' - '0' - 10);
+  size_t i = 0;
+  for (; i + 16 <= length; i += 16) {
+    __m128i bytes = _mm_loadu_si128((const __m128i *)(input + i));
+    __m128i hi = _mm_and_si128(_mm_srli_epi16(bytes, 4), mask);
+    __m128i lo = _mm_and_si128(bytes, mask);
+    hi = _mm_add_epi8(
+      _mm_add_epi8(hi, zero),
+      _mm_and_si128(_mm_cmpgt_epi8(hi, nine), alpha)
+    );
+    lo = _mm_add_epi8(
+      _mm_add_epi8(lo, zero),
+      _mm_and_si128(_mm_cmpgt_epi8(lo, nine), alpha)
+    );
+    _mm_storeu_si128((__m128i *)(output + 2 * i), _mm_unpacklo_epi8(hi, lo));
+    _mm_storeu_si128((__m128i *)(output + 2 * i + 16), _mm_unpackhi_epi8(hi, lo));
+  }
+  vLogHexEncodeScalar(output + 2 * i, input + i, length - i);
+}
+#endif
+
+#ifdef VLOG_HEX_AVX2
+/**
+ * AVX2 kernel, same as SSE2 with 32 bytes per round; the remainder
+ * (e.g. a whole 16 bytes hexdump row) goes through the SSE2 kernel
+ */
+__attribute__((target("avx2")))
+static void vLogHexEncodeAvx2(char *output, const unsigned char *input, size_t length) {
+  const __m256i mask = _mm256_set1_epi8(0x0f);
+  const __m256i nine = _mm256_set1_epi8(9);
+  const __m256i zero = _mm256_set1_epi8('0');
+  const __m256i alpha = _mm256_set1_epi8('a' - '0' - 10);
+  size_t i = 0;
+  for (; i + 32 <= length; i += 32) {
+    __m256i bytes = _mm256_loadu_si256((const __m256i *)(input + i));
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(bytes, 4), mask);
+    __m256i lo = _mm256_and_si256(bytes, mask);
+    hi = _mm256_add_epi8(
+      _mm256_add_epi8(hi, zero),
+      _mm256_and_si256(_mm256_cmpgt_epi8(hi, nine), alpha)
+    );
+    lo = _mm256_add_epi8(
+      _mm256_add_epi8(lo, zero),
+      _mm256_and_si256(_mm256_cmpgt_epi8(lo, nine), alpha)
+    );
+    // Unpacking works within 128-bit lanes, so swap the halves back
+    __m256i first = _mm256_unpacklo_epi8(hi, lo);
+    __m256i second = _mm256_unpackhi_epi8(hi, lo);
+    _mm256_storeu_si256(
+      (__m256i *)(output + 2 * i),
+      _mm256_permute2x128_si256(first, second, 0x20)
+    );
+    _mm256_storeu_si256(
+      (__m256i *)(output + 2 * i + 32),
+      _mm256_permute2x128_si256(first, second, 0x31)
+    );
+  }
+  #ifdef __SSE2__
+    vLogHexEncodeSse2(output + 2 * i, input + i, length - i);
+  #else
+    vLogHexEncodeScalar(output + 2 * i, input + i, length - i);
+  #endif
+}
+#endif
+
+/**
+ * Converts length bytes into 2 * length lowercase hex digits,
+ * using the best kernel the CPU supports
+ */
+static void vLogHexEncode(char *output, const unsigned char *input, size_t length) {
+  switch (vLogHexKernelActive()) {
+    #ifdef VLOG_HEX_AVX2
+      case kHexAvx2:
+        vLogHexEncodeAvx2(output, input, length);
+        return;
+    #endif
+    #ifdef __SSE2__
+      case kHexSse2:
+        vLogHexEncodeSse2(output, input, length);
+        return;
+    #endif
+    default:
+      vLogHexEncodeScalar(output, input, length);
+  }
+}
+
+/**
+ * Copies length bytes replacing the non printable ones with dots
+ */
+static void vLogHexPrintable(char *output, const unsigned char *input, size_t length) {
+  size_t i = 0;
+
+  #ifdef __SSE2__
+    if (vLogHexKernelActive() != kHexScalar) {
+      // Signed compares also rule out bytes >= 0x80
+      const __m128i space = _mm_set1_epi8(0x1f);
+      const __m128i del = _mm_set1_epi8(0x7f);
+      const __m128i dots = _mm_set1_epi8('.');
+      for (; i + 16 <= length; i += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(input + i));
+        __m128i printable = _mm_and_si128(
+          _mm_cmpgt_epi8(bytes, space),
+          _mm_cmplt_epi8(bytes, del)
+        );
+        _mm_storeu_si128(
+          (__m128i *)(output + i),
+          _mm_or_si128(
+            _mm_and_si128(printable, bytes),
+            _mm_andnot_si128(printable, dots)
+          )
+        );
+      }
+    }
+  #endif
+
+  for (; i < length; i++) {
+    output[i] = (input[i] > 0x1f && input[i] < 0x7f) ? input[i] : '.';
+  }
+}
+
+/**
+ * Writes a classic hexdump row and returns its length, e.g.
+ * 00000010  10 11 12 13 14 15 16 17  18 19 1a 1b 1c 1d 1e 1f  |................|
+ */
+static size_t vLogHexdumpRow(char *row, size_t offset, const unsigned char *bytes, size_t length) {
+  char hex[2 * kHexdumpRowBytes];
+  vLogHexEncode(hex, bytes, length);
+
+  static const char digits[] = "0123456789abcdef";
+  for (int i = 7; i >= 0; i--, offset >>= 4) {
+    row[i] = digits[offset & 0x0f];
+  }
+  memset(row + 8, ' ', kHexdumpRowSize - 8);
+
+  char *column = row + 10;
+  for (size_t i = 0; i < kHexdumpRowBytes; i++) {
+    if (i < length) {
+      column[0] = hex[2 * i];
+      column[1] = hex[2 * i + 1];
+    }
+    column += (i == 7) ? 4 : 3;
+  }
+  column++;
+  *column++ = '|';
+  vLogHexPrintable(column, bytes, length);
+  column[length] = '|';
+  return column + length + 1 - row;
+}
+
+/**
+ * Message body writer for hexdumps: writes the label followed by as
+ * much of the remaining payload as fits in the buffer
+ */
+static size_t vLogFormatHexdump(char *buffer, size_t size, void *data) {
+  vLogHexdumpBody *dump = data;
+  char *cursor = buffer;
+  char *end = buffer + size - 1;
+  char digits[24];
+  char *digitsEnd = digits + sizeof(digits);
+  char *first = vLogFormatUnsigned(digitsEnd, dump->length);
+
+  cursor = vLogEmit(cursor, end, dump->label, strlen(dump->label), 0);
+  cursor = vLogEmit(cursor, end, " (", 2, 0);
+  cursor = vLogEmit(cursor, end, first, digitsEnd - first, 0);
+  cursor = vLogEmit(cursor, end, " bytes)", 7, 0);
+
+  size_t start = dump->offset;
+  if (dump->options == LOG_HEX_COMPACT) {
+    cursor = vLogEmit(cursor, end, ": ", 2, 0);
+    size_t count = (end - cursor) / 2;
+    if (count > dump->length - dump->offset) {
+      count = dump->length - dump->offset;
+    }
+    vLogHexEncode(cursor, dump->data + dump->offset, count);
+    cursor += 2 * count;
+    dump->offset += count;
+  } else {
+    while (dump->offset < dump->length && end - cursor > kHexdumpRowSize) {
+      size_t count = dump->length - dump->offset;
+      if (count > kHexdumpRowBytes) {
+        count = kHexdumpRowBytes;
+      }
+      *cursor++ = '\n';
+      cursor += vLogHexdumpRow(cursor, dump->offset, dump->data + dump->offset, count);
+      dump->offset += count;
+    }
+  }
+
+  // The layout leaves no room for the payload, give up
+  if (dump->offset == start) {
+    dump->offset = dump->length;
+  }
+  return cursor - buffer;
+}
 
-  // Generate the whole message by parsing the remaining
-  // part of the format string
-  char output[kOutputBufferSize] = {};
-  vsnprintf(
-    output,
-    sizeof(output),
-    message,
-    args
-  );
+void vLogHexdump(int level, const char *label, const void *data, size_t length, int options) {
+  if (!vLogLevel || vLogLevel > level || level > LOG_FATAL || level % 10 != 0) {
+    return;
+  }
 
-  va_end(args);
+  vLogHexdumpBody dump = {
+    .label = (label != NULL) ? label : "",
+    .data = data,
+    .length = (data != NULL) ? length : 0,
+    .options = options
+  };
 
-  // Safely write to stream
-  write(STDERR_FILENO, output, strlen(output));
+  // Rows are encoded straight into the output buffer,
+  // one entry per buffer until the payload is consumed
+  char output[kOutputBufferSize];
+  do {
+    size_t outputLength = vLogFormat(
+      output,
+      sizeof(output),
+      vLogLevelLabels[level / 10],
+      vLogFormatHexdump,
+      &dump
+    );
+    vLogOutput(level, output, outputLength);
+  } while (dump.offset < dump.length);
 }
 
 #ifdef Test_operations
   #include <stdlib.h>
   #include <assert.h>
+  #include <sys/time.h>
+  #include <sys/wait.h>
+  #include <netinet/in.h>
+  #include <arpa/inet.h>
+
+  /// Keeps logUntilStopped running
+  static atomic_bool keepLogging = false;
+
+  /**
+   * Logs lines in a loop until told to stop
+   */
+  void* logUntilStopped(void* data) {
+    (void)data;
+    while (atomic_load(&keepLogging)) {
+      Info("Logging while the sink closes");
+    }
+    return NULL;
+  }
+
+  /**
+   * Logs a line from a thread with its own context
+   */
+  void* logFromThread(void* data) {
+    (void)data;
+    Info("Thread without context");
+    assert(vLogContextPush("worker", "1"));
+    Info("Thread with context");
+    return NULL;
+  }
+
+  /**
+   * Logs a single line at a durable level
+   */
+  void* logDurableOnce(void* data) {
+    int *id = (int *)data;
+    Error("[Thread %d] grouped line", *id);
+    return NULL;
+  }
+
+  /**
+   * Logs a batch of lines at a durable level
+   */
+  void* logDurable(void* data) {
+    int *id = (int *)data;
+    for (int i = 0; i < 50; i++) {
+      Error("[Thread %d] durable line %d", *id, i);
+    }
+    return NULL;
+  }
+
+  /**
+   * Returns the number of group commits so far
+   */
+  unsigned long long durableSyncs() {
+    pthread_mutex_lock(&vLogDurable.lock);
+    unsigned long long syncs = vLogDurable.syncs;
+    pthread_mutex_unlock(&vLogDurable.lock);
+    return syncs;
+  }
 
   int main(/*int argc, char const *argv[]*/) {
     // Used to verify that the PID is written into the log
@@ -237,6 +2433,805 @@ void vLogMessage(const char *label, const char *format, ...) {
     assert(remove(logFilePath) == 0);
     printf(".");
 
+    // Socket sink, with a local datagram listener standing in for /dev/log
+    char *socketPath = "/tmp/vlogger-test.sock";
+    struct sockaddr_un local = {.sun_family = AF_UNIX};
+    strcpy(local.sun_path, socketPath);
+    struct timeval timeout = {.tv_sec = 2};
+    unlink(socketPath);
+
+    int listener = socket(AF_UNIX, SOCK_DGRAM, 0);
+    assert(bind(listener, (struct sockaddr *)&local, sizeof(local)) == 0);
+    setsockopt(listener, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    printf(".");
+
+    // Fails with an unknown socket type
+    assert(!vLogInitSocket(42, socketPath));
+    printf(".");
+
+    assert(vLogInitSocket(LOG_SOCKET_UNIX, socketPath));
+    printf(".");
+
+    Info("A simple info message with param: %d", rand());
+    Error("A simple error message with param: %d", rand());
+
+    // Each line is a syslog datagram with no trailing newline
+    ssize_t received = recv(listener, line, sizeof(line) - 1, 0);
+    assert(received > 0);
+    line[received] = '\0';
+    sprintf(expected, " %d | %lu | INFO", mypid, mytid);
+    assert(strncmp(line, "<14>", 4) == 0 && strstr(line, expected) != NULL);
+    assert(line[received - 1] != '\n');
+    printf(".");
+
+    received = recv(listener, line, sizeof(line) - 1, 0);
+    assert(received > 0);
+    line[received] = '\0';
+    sprintf(expected, " %d | %lu | ERROR", mypid, mytid);
+    assert(strncmp(line, "<11>", 4) == 0 && strstr(line, expected) != NULL);
+    printf(".");
+
+    // Synced lines are sent by the time the call returns
+    assert(vLogSetDurability(LOG_ERROR, LOG_DURABLE_SYNC));
+    Error("A synced error");
+    received = recv(listener, line, sizeof(line) - 1, MSG_DONTWAIT);
+    assert(received > 0);
+    line[received] = '\0';
+    assert(strstr(line, "| A synced error") != NULL);
+    assert(vLogSetDurability(LOG_ERROR, LOG_DURABLE_NONE));
+    printf(".");
+
+    // Lines are kept while the collector is down and sent on reconnect
+    close(listener);
+    unlink(socketPath);
+    Warn("A warning sent while disconnected");
+    usleep(100000);
+    Warn("Another warning sent while disconnected");
+
+    listener = socket(AF_UNIX, SOCK_DGRAM, 0);
+    assert(bind(listener, (struct sockaddr *)&local, sizeof(local)) == 0);
+    setsockopt(listener, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    for (int i = 0; i < 2; i++) {
+      received = recv(listener, line, sizeof(line) - 1, 0);
+      assert(received > 0);
+      line[received] = '\0';
+      assert(strncmp(line, "<12>", 4) == 0 && strstr(line, "disconnected") != NULL);
+    }
+    printf(".");
+
+    vLogCloseSocket();
+    close(listener);
+    unlink(socketPath);
+    printf(".");
+
+    // Socket sink with a local TCP collector
+    struct sockaddr_in inet = {.sin_family = AF_INET};
+    socklen_t inetLength = sizeof(inet);
+    inet.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    assert(bind(listener, (struct sockaddr *)&inet, sizeof(inet)) == 0);
+    assert(listen(listener, 1) == 0);
+    assert(getsockname(listener, (struct sockaddr *)&inet, &inetLength) == 0);
+
+    char collector[32] = {};
+    sprintf(collector, "127.0.0.1:%d", ntohs(inet.sin_port));
+    assert(vLogInitSocket(LOG_SOCKET_TCP, collector));
+    printf(".");
+
+    int connection = accept(listener, NULL, NULL);
+    assert(connection >= 0);
+    setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    for (int i = 0; i < 100; i++) {
+      Info("TCP line %d", i);
+    }
+
+    // Closing flushes the queue and the connection
+    vLogCloseSocket();
+    char stream[kOutputBufferSize * 16] = {};
+    size_t streamLength = 0;
+    while ((received = recv(
+      connection, stream + streamLength, sizeof(stream) - streamLength - 1, 0
+    )) > 0) {
+      streamLength += received;
+    }
+    int lines = 0;
+    for (size_t i = 0; i < streamLength; i++) {
+      lines += (stream[i] == '\n');
+    }
+    assert(lines == 100);
+    assert(strstr(stream, "| TCP line 0\n") != NULL);
+    assert(strstr(stream, "| TCP line 99\n") != NULL);
+    close(connection);
+    close(listener);
+    printf(".");
+
+    // Closing waits for the threads that are still pushing lines
+    listener = socket(AF_UNIX, SOCK_DGRAM, 0);
+    assert(bind(listener, (struct sockaddr *)&local, sizeof(local)) == 0);
+    setsockopt(listener, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    for (int round = 0; round < 20; round++) {
+      assert(vLogInitSocket(LOG_SOCKET_UNIX, socketPath));
+      atomic_store(&keepLogging, true);
+      pthread_t loggers[4];
+      for (int i = 0; i < 4; i++) {
+        assert(pthread_create(&loggers[i], NULL, logUntilStopped, NULL) == 0);
+      }
+      usleep(1000);
+      vLogCloseSocket();
+      atomic_store(&keepLogging, false);
+      for (int i = 0; i < 4; i++) {
+        assert(pthread_join(loggers[i], NULL) == 0);
+      }
+    }
+    printf(".");
+
+    // A forked child has no sender thread, its lines go to the stream
+    // and it exits without waiting for a drain
+    while (recv(listener, line, sizeof(line) - 1, MSG_DONTWAIT) > 0) {}
+    assert(vLogInitSocket(LOG_SOCKET_UNIX, socketPath));
+    fflush(stdout);
+    long long forkStarted = vLogClockMs();
+    pid_t forked = fork();
+    if (forked == 0) {
+      Info("Line of a forked child");
+      exit(EXIT_SUCCESS);
+    }
+    int forkedStatus = 0;
+    assert(waitpid(forked, &forkedStatus, 0) == forked);
+    assert(WIFEXITED(forkedStatus) && WEXITSTATUS(forkedStatus) == EXIT_SUCCESS);
+    assert(vLogClockMs() - forkStarted < kSinkDrainMs);
+    vLogCloseSocket();
+    assert(recv(listener, line, sizeof(line) - 1, MSG_DONTWAIT) < 0);
+    printf(".");
+
+    close(listener);
+    unlink(socketPath);
+    printf(".");
+
+    // Queued lines, like the one of a Fatal, are delivered on exit
+    listener = socket(AF_UNIX, SOCK_DGRAM, 0);
+    assert(bind(listener, (struct sockaddr *)&local, sizeof(local)) == 0);
+    setsockopt(listener, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    fflush(stdout);
+    pid_t sender = fork();
+    if (sender == 0) {
+      vLogInitSocket(LOG_SOCKET_UNIX, socketPath);
+      errno = 0;
+      Fatal("Fatal line over the socket");
+    }
+    received = recv(listener, line, sizeof(line) - 1, 0);
+    assert(received > 0);
+    line[received] = '\0';
+    assert(strncmp(line, "<10>", 4) == 0 && strstr(line, "Fatal line over the socket") != NULL);
+    int senderStatus = 0;
+    assert(waitpid(sender, &senderStatus, 0) == sender);
+    assert(WIFEXITED(senderStatus) && WEXITSTATUS(senderStatus) == EXIT_FAILURE);
+    close(listener);
+    unlink(socketPath);
+    printf(".");
+
+    // Custom layouts
+    assert(vLogInit(LOG_INFO, logFilePath));
+    printf(".");
+
+    // Invalid patterns are rejected
+    assert(!vLogSetLayout("{ts} {lvl}"));
+    assert(!vLogSetLayout("{msg} {msg}"));
+    assert(!vLogSetLayout("{nope} {msg}"));
+    assert(!vLogSetLayout("{lvl:wide} {msg}"));
+    assert(!vLogSetLayout("{ts:ns} {msg}"));
+    assert(!vLogSetLayout("{lvl {msg}"));
+    assert(!vLogSetLayout("} {msg}"));
+    assert(!vLogSetLayout("{msg:xml}"));
+    assert(!vLogSetLayout("{msg:json} {msg}"));
+    printf(".");
+
+    // The default pattern compiles to the same output
+    assert(vLogSetLayout("{ts} | {pid:6} | {tid} | {lvl:-7} | {ctx: | }{msg}"));
+    Info("Default layout");
+
+    assert(vLogSetLayout("{lvl}: {msg}"));
+    Info("Short layout with param: %d", 42);
+
+    assert(vLogSetLayout("{{{lvl:8}}} [{tid}] {msg} ({pid})"));
+    Warn("Padded level");
+
+    assert(vLogSetLayout("{ts:ms} {msg}"));
+    Error("Milliseconds");
+
+    // Lines are truncated but always end with a newline
+    assert(vLogSetLayout(NULL));
+    char longMessage[kOutputBufferSize * 2] = {};
+    memset(longMessage, 'x', sizeof(longMessage) - 1);
+    Info("%s", longMessage);
+
+    logReader = fopen(logFilePath, "r");
+    assert(logReader != NULL);
+    printf(".");
+
+    fgets(line, kOutputBufferSize, logReader);
+    sprintf(expected, " %6d | %lu | INFO    | Default layout\n", mypid, mytid);
+    assert(strstr(line, expected) != NULL);
+    printf(".");
+
+    fgets(line, kOutputBufferSize, logReader);
+    assert(strcmp(line, "INFO: Short layout with param: 42\n") == 0);
+    printf(".");
+
+    fgets(line, kOutputBufferSize, logReader);
+    sprintf(expected, "{ WARNING} [%lu] Padded level (%d)\n", mytid, mypid);
+    assert(strcmp(line, expected) == 0);
+    printf(".");
+
+    // e.g. 2022-04-07T16:09:33.123+0100 Milliseconds
+    fgets(line, kOutputBufferSize, logReader);
+    assert(line[10] == 'T' && line[19] == '.' && strstr(line, " Milliseconds\n") != NULL);
+    printf(".");
+
+    char longLine[kOutputBufferSize * 2] = {};
+    fgets(longLine, sizeof(longLine), logReader);
+    assert(strlen(longLine) == kOutputBufferSize);
+    assert(longLine[kOutputBufferSize - 1] == '\n');
+    printf(".");
+
+    // There should be no more lines
+    assert(fgets(line, kOutputBufferSize, logReader) == NULL);
+    printf(".");
+
+    // TEARDOWN(3): remove leftover log file
+    fclose(logReader);
+    assert(remove(logFilePath) == 0);
+    printf(".");
+
+    // Hex encoding matches printf for every byte value and
+    // for lengths covering both the vector and scalar paths,
+    // on every kernel this CPU supports
+    unsigned char payload[4096];
+    char encoded[2 * sizeof(payload) + 1] = {};
+    char reference[2 * sizeof(payload) + 1] = {};
+    char printable[sizeof(payload)] = {};
+    int supported = vLogHexKernelSupported();
+    for (int kernel = kHexScalar; kernel <= supported; kernel++) {
+      #ifndef __SSE2__
+        if (kernel == kHexSse2) {
+          continue;
+        }
+      #endif
+      atomic_store(&vLogHexKernel, kernel);
+      for (size_t i = 0; i < sizeof(payload); i++) {
+        payload[i] = (i * 7 + i / 256) & 0xff;
+      }
+      for (size_t length = 0; length < 100; length++) {
+        vLogHexEncode(encoded, payload + length, length);
+        for (size_t i = 0; i < length; i++) {
+          sprintf(reference + 2 * i, "%02x", payload[length + i]);
+        }
+        assert(memcmp(encoded, reference, 2 * length) == 0);
+      }
+      for (size_t i = 0; i < 256; i++) {
+        payload[i] = i;
+      }
+      vLogHexEncode(encoded, payload, 256);
+      for (size_t i = 0; i < 256; i++) {
+        sprintf(reference + 2 * i, "%02x", payload[i]);
+      }
+      assert(memcmp(encoded, reference, 512) == 0);
+      vLogHexPrintable(printable, payload, 256);
+      for (size_t i = 0; i < 256; i++) {
+        assert(printable[i] == ((i > 0x1f && i < 0x7f) ? (char)i : '.'));
+      }
+    }
+    atomic_store(&vLogHexKernel, supported);
+    printf(".");
+
+    // Hexdumps
+    assert(vLogInit(LOG_INFO, logFilePath));
+    assert(vLogSetLayout("{lvl} {msg}"));
+    printf(".");
+
+    unsigned char frame[40];
+    for (size_t i = 0; i < sizeof(frame); i++) {
+      frame[i] = i + 0x1e;
+    }
+    InfoHex("frame", frame, sizeof(frame), LOG_HEX_CLASSIC);
+    WarnHex("frame", frame, 4, LOG_HEX_COMPACT);
+
+    // Disabled levels are skipped
+    DebugHex("frame", frame, sizeof(frame), LOG_HEX_CLASSIC);
+    vLogHexdump(LOG_TRACE, "frame", frame, sizeof(frame), LOG_HEX_COMPACT);
+
+    // Large payloads span multiple entries
+    InfoHex("large", payload, sizeof(payload), LOG_HEX_CLASSIC);
+    InfoHex("large", payload, sizeof(payload), LOG_HEX_COMPACT);
+    assert(vLogSetLayout(NULL));
+
+    logReader = fopen(logFilePath, "r");
+    assert(logReader != NULL);
+    printf(".");
+
+    fgets(line, kOutputBufferSize, logReader);
+    assert(strcmp(line, "INFO frame (40 bytes)\n") == 0);
+    fgets(line, kOutputBufferSize, logReader);
+    assert(strcmp(line,
+      "00000000  1e 1f 20 21 22 23 24 25  26 27 28 29 2a 2b 2c 2d  |.. !\"#$%&'()*+,-|\n"
+    ) == 0);
+    fgets(line, kOutputBufferSize, logReader);
+    assert(strcmp(line,
+      "00000010  2e 2f 30 31 32 33 34 35  36 37 38 39 3a 3b 3c 3d  |./0123456789:;<=|\n"
+    ) == 0);
+    fgets(line, kOutputBufferSize, logReader);
+    assert(strcmp(line,
+      "00000020  3e 3f 40 41 42 43 44 45                           |>?@ABCDE|\n"
+    ) == 0);
+    printf(".");
+
+    fgets(line, kOutputBufferSize, logReader);
+    assert(strcmp(line, "WARNING frame (4 bytes): 1e1f2021\n") == 0);
+    printf(".");
+
+    // Classic: every row is there, in order
+    size_t rows = 0;
+    size_t headers = 0;
+    while (rows < sizeof(payload) / 16 && fgets(line, kOutputBufferSize, logReader) != NULL) {
+      if (strcmp(line, "INFO large (4096 bytes)\n") == 0) {
+        headers++;
+        continue;
+      }
+      sprintf(expected, "%08zx  %02x ", rows * 16, payload[rows * 16]);
+      assert(strncmp(line, expected, strlen(expected)) == 0);
+      rows++;
+    }
+    assert(rows == sizeof(payload) / 16 && headers > 1);
+    printf(".");
+
+    // Compact: the hex strings add up to the payload
+    size_t decoded = 0;
+    char *prefix = "INFO large (4096 bytes): ";
+    while (decoded < sizeof(payload) && fgets(longLine, sizeof(longLine), logReader) != NULL) {
+      assert(strncmp(longLine, prefix, strlen(prefix)) == 0);
+      char *hex = longLine + strlen(prefix);
+      size_t count = (strlen(hex) - 1) / 2;
+      vLogHexEncode(encoded, payload + decoded, count);
+      assert(memcmp(hex, encoded, 2 * count) == 0);
+      decoded += count;
+    }
+    assert(decoded == sizeof(payload));
+    printf(".");
+
+    // There should be no more lines
+    assert(fgets(line, kOutputBufferSize, logReader) == NULL);
+    printf(".");
+
+    // TEARDOWN(4): remove leftover log file
+    fclose(logReader);
+    assert(remove(logFilePath) == 0);
+    printf(".");
+
+    // Context fields
+    assert(vLogInit(LOG_INFO, logFilePath));
+    printf(".");
+
+    assert(vLogContextPush("req", "abc"));
+    assert(vLogContextPush("tenant", "t1"));
+    Info("Two fields");
+    vLogContextPop();
+    Info("One field");
+
+    // The context belongs to the calling thread
+    pthread_t worker;
+    assert(pthread_create(&worker, NULL, logFromThread, NULL) == 0);
+    assert(pthread_join(worker, NULL) == 0);
+
+    vLogContextPop();
+    vLogContextPop();
+    Info("No fields");
+
+    // Literals around an empty context are kept
+    assert(vLogSetLayout("[{ctx}] {lvl}: {msg}"));
+    Info("No context");
+    assert(vLogSetLayout("{ctx:, }{msg}"));
+    Info("No suffix");
+    assert(vLogContextPush("req", "abc"));
+    Info("Suffix");
+    vLogContextClear();
+
+    // Values and messages are escaped for JSON
+    assert(vLogSetLayout("{{\"lvl\":\"{lvl}\",{ctx:json}\"msg\":\"{msg:json}\"}}"));
+    assert(vLogContextPush("req", "a\"b"));
+    Info("JSON");
+    vLogContextClear();
+    Info("Say \"%s\"\t\\", "hi");
+    assert(vLogSetLayout(NULL));
+
+    // The context is bounded
+    char longValue[kContextBufferSize] = {};
+    memset(longValue, 'x', sizeof(longValue) - 1);
+    assert(!vLogContextPush("long", longValue));
+    for (int i = 0; i < kContextMaxDepth; i++) {
+      assert(vLogContextPush("k", "v"));
+    }
+    assert(!vLogContextPush("k", "v"));
+    vLogContextClear();
+    printf(".");
+
+    logReader = fopen(logFilePath, "r");
+    assert(logReader != NULL);
+    printf(".");
+
+    fgets(line, kOutputBufferSize, logReader);
+    assert(strstr(line, "| INFO    | req=abc tenant=t1 | Two fields\n") != NULL);
+    fgets(line, kOutputBufferSize, logReader);
+    assert(strstr(line, "| INFO    | req=abc | One field\n") != NULL);
+    printf(".");
+
+    fgets(line, kOutputBufferSize, logReader);
+    assert(strstr(line, "| INFO    | Thread without context\n") != NULL);
+    fgets(line, kOutputBufferSize, logReader);
+    assert(strstr(line, "| INFO    | worker=1 | Thread with context\n") != NULL);
+    printf(".");
+
+    fgets(line, kOutputBufferSize, logReader);
+    assert(strstr(line, "| INFO    | No fields\n") != NULL);
+    printf(".");
+
+    fgets(line, kOutputBufferSize, logReader);
+    assert(strcmp(line, "[] INFO: No context\n") == 0);
+    fgets(line, kOutputBufferSize, logReader);
+    assert(strcmp(line, "No suffix\n") == 0);
+    fgets(line, kOutputBufferSize, logReader);
+    assert(strcmp(line, "req=abc, Suffix\n") == 0);
+    printf(".");
+
+    fgets(line, kOutputBufferSize, logReader);
+    assert(strcmp(line, "{\"lvl\":\"INFO\",\"req\":\"a\\\"b\",\"msg\":\"JSON\"}\n") == 0);
+    fgets(line, kOutputBufferSize, logReader);
+    assert(strcmp(line, "{\"lvl\":\"INFO\",\"msg\":\"Say \\\"hi\\\"\\u0009\\\\\"}\n") == 0);
+    printf(".");
+
+    // There should be no more lines
+    assert(fgets(line, kOutputBufferSize, logReader) == NULL);
+    printf(".");
+
+    // TEARDOWN(5): remove leftover log file
+    fclose(logReader);
+    assert(remove(logFilePath) == 0);
+    printf(".");
+
+    // Durability policies
+    assert(vLogInit(LOG_INFO, logFilePath));
+    assert(!vLogSetDurability(LOG_OFF, LOG_DURABLE_SYNC));
+    assert(!vLogSetDurability(LOG_ERROR, 42));
+    assert(!vLogSetDurability(LOG_ERROR + 1, LOG_DURABLE_SYNC));
+    assert(!vLogSetDurability(LOG_FATAL, LOG_DURABLE_NONE));
+    assert(vLogSetDurability(LOG_FATAL, LOG_DURABLE_SYNC));
+    assert(!vLogSetSyncInterval(0));
+    printf(".");
+
+    // Lines at a synced level wait for a group commit
+    assert(vLogSetDurability(LOG_ERROR, LOG_DURABLE_SYNC));
+    unsigned long long syncs = durableSyncs();
+    pthread_t writers[8];
+    int writerIds[8];
+    for (int i = 0; i < 8; i++) {
+      writerIds[i] = i;
+      assert(pthread_create(&writers[i], NULL, logDurable, &writerIds[i]) == 0);
+    }
+    for (int i = 0; i < 8; i++) {
+      assert(pthread_join(writers[i], NULL) == 0);
+    }
+    pthread_mutex_lock(&vLogDurable.lock);
+    assert(vLogDurable.synced == atomic_load(&vLogDurable.written));
+    pthread_mutex_unlock(&vLogDurable.lock);
+    assert(durableSyncs() > syncs);
+    printf(".");
+
+    // Lines written while a sync is running share the next one
+    pthread_mutex_lock(&vLogDurable.lock);
+    vLogDurable.syncing = true;
+    pthread_mutex_unlock(&vLogDurable.lock);
+    unsigned long long written = atomic_load(&vLogDurable.written);
+    syncs = durableSyncs();
+    for (int i = 0; i < 8; i++) {
+      assert(pthread_create(&writers[i], NULL, logDurableOnce, &writerIds[i]) == 0);
+    }
+    while (atomic_load(&vLogDurable.written) < written + 8) {
+      usleep(1000);
+    }
+    pthread_mutex_lock(&vLogDurable.lock);
+    vLogDurable.syncing = false;
+    pthread_cond_broadcast(&vLogDurable.done);
+    pthread_mutex_unlock(&vLogDurable.lock);
+    for (int i = 0; i < 8; i++) {
+      assert(pthread_join(writers[i], NULL) == 0);
+    }
+    assert(durableSyncs() == syncs + 1);
+    printf(".");
+
+    // Lines at other levels don't
+    syncs = durableSyncs();
+    Info("Not durable");
+    assert(durableSyncs() == syncs);
+    printf(".");
+
+    // Periodic lines are synced by the background thread
+    assert(vLogSetSyncInterval(20));
+    assert(vLogSetDurability(LOG_INFO, LOG_DURABLE_PERIODIC));
+    assert(vLogDurable.running);
+
+    // Each call sets a single level
+    assert(atomic_load(&vLogDurable.policies[LOG_WARN / 10]) == LOG_DURABLE_NONE);
+    assert(atomic_load(&vLogDurable.policies[LOG_ERROR / 10]) == LOG_DURABLE_SYNC);
+    Info("Periodic");
+    assert(durableSyncs() == syncs);
+    for (int i = 0; i < 100 && durableSyncs() == syncs; i++) {
+      usleep(10000);
+    }
+    assert(durableSyncs() > syncs);
+    printf(".");
+
+    assert(vLogSetDurability(LOG_INFO, LOG_DURABLE_NONE));
+    assert(!vLogDurable.running);
+    assert(vLogSetDurability(LOG_ERROR, LOG_DURABLE_NONE));
+    assert(vLogSetSyncInterval(1000));
+    printf(".");
+
+    // Preallocation reserves space without changing the file size
+    // (unless the file system doesn't support it)
+    struct stat info = {};
+    if (vLogPreallocate(1 << 20)) {
+      Info("Preallocated");
+      assert(fstat(STDERR_FILENO, &info) == 0);
+      assert(info.st_blocks * 512 >= (1 << 20) && info.st_size < (1 << 20));
+    } else {
+      assert(errno == EOPNOTSUPP);
+    }
+    printf(".");
+
+    // FATAL lines are synced before exit
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == 0) {
+      errno = 0;
+      Fatal("Fatal line");
+    }
+    int status = 0;
+    assert(waitpid(child, &status, 0) == child);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_FAILURE);
+    printf(".");
+
+    logReader = fopen(logFilePath, "r");
+    assert(logReader != NULL);
+    int durableLines = 0;
+    while (fgets(line, kOutputBufferSize, logReader) != NULL) {
+      durableLines += (strstr(line, "| ERROR   | [Thread ") != NULL);
+      if (strstr(line, "| FATAL   | ") != NULL) {
+        assert(strstr(line, "Fatal line\n") != NULL);
+        durableLines++;
+      }
+    }
+    assert(durableLines == 8 * 50 + 8 + 1);
+    printf(".");
+
+    // TEARDOWN(6): remove leftover log file
+    fclose(logReader);
+    assert(remove(logFilePath) == 0);
+    printf(".");
+
+  #ifndef VLOGGER_NO_COMPRESSION
+    // Compression round trips on text, repetitive and random-ish
+    // data, covering long literal runs and long overlapping matches
+    static unsigned char block[LOG_FRAME_SIZE];
+    static unsigned char compressed[vLogCompressBound(LOG_FRAME_SIZE)];
+    static unsigned char restored[LOG_FRAME_SIZE];
+    size_t sizes[] = {0, 1, 12, 13, 15, 16, 300, 4096, LOG_FRAME_SIZE};
+    for (size_t kind = 0; kind < 3; kind++) {
+      unsigned int noise = 2463534242u;
+      for (size_t i = 0; i < sizeof(block); i++) {
+        noise ^= noise << 13;
+        noise ^= noise >> 17;
+        noise ^= noise << 5;
+        block[i] = (kind == 0) ? "2022-04-07T16:09:33+0100 | INFO | hello\n"[i % 41]
+          : (kind == 1) ? 'x'
+          : (unsigned char)noise;
+      }
+      for (size_t j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++) {
+        size_t compressedLength = vLogCompress(compressed, block, sizes[j]);
+        assert(compressedLength <= vLogCompressBound(sizes[j]));
+        long restoredLength = vLogDecompress(restored, sizeof(restored), compressed, compressedLength);
+        assert(restoredLength == (long)sizes[j]);
+        assert(memcmp(block, restored, sizes[j]) == 0);
+      }
+    }
+    assert(vLogCompress(compressed, block, 4096) > 4000);
+    for (size_t i = 0; i < sizeof(block); i++) {
+      block[i] = 'x';
+    }
+    assert(vLogCompress(compressed, block, LOG_FRAME_SIZE) < 300);
+    printf(".");
+
+    // Corrupted blocks are rejected
+    size_t compressedLength = vLogCompress(compressed, block, 4096);
+    assert(vLogDecompress(restored, 100, compressed, compressedLength) < 0);
+    assert(vLogDecompress(restored, sizeof(restored), compressed, compressedLength - 1) < 0);
+    printf(".");
+
+    // Compressed sink
+    char *compressedPath = "/tmp/vlogger-test.vlz";
+    unlink(compressedPath);
+    assert(!vLogInitCompressed("/nonexistent/vlogger.vlz"));
+    assert(vLogInitCompressed(compressedPath));
+    printf(".");
+
+    // Frames are flushed shortly after their first line
+    Info("Compressed line");
+    struct stat compressedInfo = {};
+    for (int i = 0; i < 200 && compressedInfo.st_size == 0; i++) {
+      usleep(10000);
+      assert(stat(compressedPath, &compressedInfo) == 0);
+    }
+    assert(compressedInfo.st_size > kFrameHeaderSize);
+    printf(".");
+
+    // Synced lines are on disk by the time the call returns
+    assert(vLogSetDurability(LOG_ERROR, LOG_DURABLE_SYNC));
+    off_t flushedSize = compressedInfo.st_size;
+    Error("Synced compressed line");
+    assert(stat(compressedPath, &compressedInfo) == 0);
+    assert(compressedInfo.st_size > flushedSize);
+    assert(vLogSetDurability(LOG_ERROR, LOG_DURABLE_NONE));
+    printf(".");
+
+    // The compressor follows the policy the line was queued with,
+    // even if the level has changed since
+    char queuedLine[] = "Queued as synced\n";
+    size_t queuedPosition = vLogQueuePush(
+      &vLogCompressed.queue, LOG_ERROR, LOG_DURABLE_SYNC, queuedLine, strlen(queuedLine)
+    );
+    assert(queuedPosition > 0);
+    struct timespec queuedDeadline = vLogDeadline(kSinkDrainMs);
+    assert(vLogQueueWaitCommit(&vLogCompressed.queue, queuedPosition, &queuedDeadline));
+    printf(".");
+
+    // Enough lines for several frames, in bursts that fit the queue
+    size_t rawSize = 0;
+    for (int burst = 0; burst < 10; burst++) {
+      for (int i = 0; i < 500; i++) {
+        Info("Compressed line %d with param: %d", burst * 500 + i, rand());
+      }
+      usleep(20000);
+    }
+    vLogCloseCompressed();
+    printf(".");
+
+    static char frameData[LOG_FRAME_SIZE];
+    FILE *compressedReader = fopen(compressedPath, "r");
+    assert(compressedReader != NULL);
+    long frameLength = 0;
+    int frames = 0;
+    int compressedLines = 0;
+    while ((frameLength = vLogReadFrame(compressedReader, frameData, sizeof(frameData))) > 0) {
+      frames++;
+      rawSize += frameLength;
+      for (char *c = frameData; c < frameData + frameLength; c++) {
+        if (*c == '\n') {
+          compressedLines++;
+        }
+      }
+      assert(frameData[frameLength - 1] == '\n');
+    }
+    assert(frameLength == 0);
+    assert(frames > 3 && compressedLines == 3 + 10 * 500);
+    assert(stat(compressedPath, &compressedInfo) == 0);
+    assert((size_t)compressedInfo.st_size < rawSize / 2);
+    fclose(compressedReader);
+    printf(".");
+
+    // A truncated last frame is detected, the others are still readable
+    assert(truncate(compressedPath, compressedInfo.st_size - 10) == 0);
+    compressedReader = fopen(compressedPath, "r");
+    for (int i = 0; i < frames - 1; i++) {
+      assert(vLogReadFrame(compressedReader, frameData, sizeof(frameData)) > 0);
+    }
+    assert(vLogReadFrame(compressedReader, frameData, sizeof(frameData)) < 0);
+    assert(vLogReadFrame(compressedReader, frameData, sizeof(frameData)) == 0);
+    fclose(compressedReader);
+    printf(".");
+
+    // A corrupted frame is skipped, reading goes on from the next one
+    compressedReader = fopen(compressedPath, "r+");
+    assert(vLogReadFrame(compressedReader, frameData, sizeof(frameData)) > 0);
+    long corrupted = ftell(compressedReader);
+    assert(fseek(compressedReader, corrupted + kFrameHeaderSize + 10, SEEK_SET) == 0);
+    int original = getc(compressedReader);
+    assert(fseek(compressedReader, corrupted + kFrameHeaderSize + 10, SEEK_SET) == 0);
+    putc(original ^ 0xff, compressedReader);
+    assert(fseek(compressedReader, corrupted, SEEK_SET) == 0);
+    errno = 0;
+    assert(vLogReadFrame(compressedReader, frameData, sizeof(frameData)) < 0 && errno == EBADMSG);
+    for (int i = 0; i < frames - 3; i++) {
+      assert(vLogReadFrame(compressedReader, frameData, sizeof(frameData)) > 0);
+    }
+    assert(vLogReadFrame(compressedReader, frameData, sizeof(frameData)) < 0);
+    assert(vLogReadFrame(compressedReader, frameData, sizeof(frameData)) == 0);
+    fclose(compressedReader);
+    assert(remove(compressedPath) == 0);
+    printf(".");
+
+    // Closing waits for the threads that are still pushing lines
+    for (int round = 0; round < 20; round++) {
+      assert(vLogInitCompressed(compressedPath));
+      atomic_store(&keepLogging, true);
+      pthread_t loggers[4];
+      for (int i = 0; i < 4; i++) {
+        assert(pthread_create(&loggers[i], NULL, logUntilStopped, NULL) == 0);
+      }
+      usleep(1000);
+      vLogCloseCompressed();
+      atomic_store(&keepLogging, false);
+      for (int i = 0; i < 4; i++) {
+        assert(pthread_join(loggers[i], NULL) == 0);
+      }
+    }
+    assert(remove(compressedPath) == 0);
+    printf(".");
+
+    // The line of a Fatal is in the file after exit
+    fflush(stdout);
+    pid_t compressor = fork();
+    if (compressor == 0) {
+      vLogInitCompressed(compressedPath);
+      errno = 0;
+      Fatal("Fatal compressed line");
+    }
+    int compressorStatus = 0;
+    assert(waitpid(compressor, &compressorStatus, 0) == compressor);
+    assert(WIFEXITED(compressorStatus) && WEXITSTATUS(compressorStatus) == EXIT_FAILURE);
+    compressedReader = fopen(compressedPath, "r");
+    frameLength = vLogReadFrame(compressedReader, frameData, sizeof(frameData) - 1);
+    assert(frameLength > 0);
+    frameData[frameLength] = '\0';
+    assert(strstr(frameData, "| FATAL   | Fatal compressed line\n") != NULL);
+    fclose(compressedReader);
+    assert(remove(compressedPath) == 0);
+    printf(".");
+
+    // Exit drains more lines than a batch without waiting for the timeout
+    fflush(stdout);
+    long long drainStarted = vLogClockMs();
+    compressor = fork();
+    if (compressor == 0) {
+      vLogInitCompressed(compressedPath);
+      for (int i = 0; i < 500; i++) {
+        Info("Drained line %d", i);
+      }
+      exit(EXIT_SUCCESS);
+    }
+    assert(waitpid(compressor, &compressorStatus, 0) == compressor);
+    assert(WIFEXITED(compressorStatus) && WEXITSTATUS(compressorStatus) == EXIT_SUCCESS);
+    assert(vLogClockMs() - drainStarted < kSinkDrainMs);
+    compressedReader = fopen(compressedPath, "r");
+    compressedLines = 0;
+    while ((frameLength = vLogReadFrame(compressedReader, frameData, sizeof(frameData))) > 0) {
+      for (char *c = frameData; c < frameData + frameLength; c++) {
+        compressedLines += (*c == '\n');
+      }
+    }
+    assert(frameLength == 0 && compressedLines == 500);
+    fclose(compressedReader);
+    printf(".");
+
+    // Lines go back to the log stream
+    assert(vLogInit(LOG_INFO, logFilePath));
+    Info("Back to the stream");
+    assert(stat(logFilePath, &compressedInfo) == 0 && compressedInfo.st_size > 0);
+    assert(remove(logFilePath) == 0);
+    assert(remove(compressedPath) == 0);
+    printf(".");
+  #else
+    assert(!vLogInitCompressed("/tmp/vlogger-test.vlz"));
+    printf(".");
+  #endif
+
     printf("DONE!\n\n");
     return EXIT_SUCCESS;
   }
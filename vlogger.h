@@ -45,6 +45,22 @@
   #define LOG_TRACE 10
   #define LOG_OFF    0
 
+  // Socket sink types
+  #define LOG_SOCKET_UNIX 1
+  #define LOG_SOCKET_TCP  2
+
+  // Maximum uncompressed size of a compressed log frame
+  #define LOG_FRAME_SIZE 65536
+
+  // Durability policies
+  #define LOG_DURABLE_NONE     0
+  #define LOG_DURABLE_PERIODIC 1
+  #define LOG_DURABLE_SYNC     2
+
+  // Hexdump output formats
+  #define LOG_HEX_CLASSIC 0
+  #define LOG_HEX_COMPACT 1
+
   // Set default level to INFO
   #ifndef LOG_DEFAULT
     #define LOG_DEFAULT LOG_INFO
@@ -93,6 +109,36 @@
   }
   #define FatalIf(expr, ...) {if (expr) Fatal(__VA_ARGS__)}
 
+  #define TraceHex(label, data, length, options) {         \
+    if (vLogLevel && vLogLevel <= LOG_TRACE) {             \
+      vLogHexdump(LOG_TRACE, label, data, length, options); \
+    }                                                      \
+  }
+
+  #define DebugHex(label, data, length, options) {         \
+    if (vLogLevel && vLogLevel <= LOG_DEBUG) {             \
+      vLogHexdump(LOG_DEBUG, label, data, length, options); \
+    }                                                      \
+  }
+
+  #define InfoHex(label, data, length, options) {         \
+    if (vLogLevel && vLogLevel <= LOG_INFO) {             \
+      vLogHexdump(LOG_INFO, label, data, length, options); \
+    }                                                     \
+  }
+
+  #define WarnHex(label, data, length, options) {         \
+    if (vLogLevel && vLogLevel <= LOG_WARN) {             \
+      vLogHexdump(LOG_WARN, label, data, length, options); \
+    }                                                     \
+  }
+
+  #define ErrorHex(label, data, length, options) {         \
+    if (vLogLevel && vLogLevel <= LOG_ERROR) {             \
+      vLogHexdump(LOG_ERROR, label, data, length, options); \
+    }                                                      \
+  }
+
   /// Contains the global log level
   extern int vLogLevel;
 
@@ -116,4 +162,190 @@
    * @param[in] args Variadic list of arguments
    */
   void vLogMessage(const char *label, const char *format, ...);
+
+  /**
+   * Sets the durability policy of a single log level
+   *
+   *  - LOG_DURABLE_NONE: lines are left to the OS (default)
+   *  - LOG_DURABLE_PERIODIC: lines are synced to disk by a background
+   *    thread every sync interval (see vLogSetSyncInterval)
+   *  - LOG_DURABLE_SYNC: the caller waits until the line is on disk
+   *
+   * Synced lines are committed in groups: one fdatasync covers all
+   * the lines written until then. FATAL lines are always synced
+   * before the program exits, so any other policy for LOG_FATAL
+   * fails with EINVAL. Waiting for a sync is not AS-Safe.
+   *
+   * With the socket sink, synced and FATAL lines wait (up to 2
+   * seconds) until the sender has handed them to the collector,
+   * and periodic lines are sent as usual. With the compressed sink
+   * they are synced along with their frame.
+   *
+   * @param[in] level One of the log level constants
+   * @param[in] policy One of the LOG_DURABLE_* constants
+   */
+  bool vLogSetDurability(int level, int policy);
+
+  /**
+   * Sets the interval of the periodic durability policy
+   *
+   * @param[in] milliseconds Time between syncs (default 1000)
+   */
+  bool vLogSetSyncInterval(unsigned int milliseconds);
+
+  /**
+   * Preallocates disk space for the log file (Linux only)
+   *
+   * The space is reserved in chunks of the given size ahead of the
+   * write offset without changing the file size, so appending lines
+   * (and syncing them) doesn't have to allocate blocks every time.
+   * Call it after vLogInit.
+   *
+   * @param[in] size Chunk size in bytes
+   */
+  bool vLogPreallocate(size_t size);
+
+  /**
+   * Writes a binary payload to the log stream as hexadecimal
+   *
+   * LOG_HEX_CLASSIC writes the label and byte count followed by
+   * offset/hex/ASCII rows, 16 bytes per row. LOG_HEX_COMPACT writes
+   * the bytes as a contiguous lowercase hex string after the label.
+   * Payloads that don't fit in a single line buffer are split into
+   * multiple entries. Nothing is done if the level is disabled.
+   *
+   * Prefer the TraceHex, DebugHex, etc macros.
+   *
+   * @param[in] level One of the log level constants
+   * @param[in] label Payload description
+   * @param[in] data Payload to dump
+   * @param[in] length Payload size in bytes
+   * @param[in] options One of LOG_HEX_CLASSIC or LOG_HEX_COMPACT
+   */
+  void vLogHexdump(int level, const char *label, const void *data, size_t length, int options);
+
+  /**
+   * Sets the layout of the log lines
+   *
+   * The pattern is compiled once into a list of operations, so
+   * nothing is parsed when writing a line and fields that are not
+   * in the layout are not computed at all. Available fields:
+   *
+   *  - {ts}: ISO 8601 local date/time (2022-04-07T16:09:33+0100)
+   *  - {ts:ms}: same with milliseconds (2022-04-07T16:09:33.123+0100)
+   *  - {pid}: process id
+   *  - {tid}: pthread id
+   *  - {lvl}: level label
+   *  - {ctx}: context fields as text (req=abc tenant=t1)
+   *  - {ctx:<suffix>}: same, followed by suffix only when the
+   *    context is not empty (e.g. {ctx: | })
+   *  - {ctx:json}: context fields as JSON members, each followed
+   *    by a comma ("req":"abc","tenant":"t1",)
+   *  - {msg}: the message, mandatory and only once
+   *  - {msg:json}: the message escaped for a JSON string
+   *
+   * Numeric arguments set a minimum width, right aligned when
+   * positive and left aligned when negative (e.g. {lvl:-7}).
+   * Use {{ and }} for literal braces. A newline is always appended.
+   *
+   * The default layout is "{ts} | {pid:6} | {tid} | {lvl:-7} | {ctx: | }{msg}".
+   * Like vLogInit, call it before other threads start logging.
+   *
+   * @param[in] pattern Layout pattern, NULL restores the default
+   */
+  bool vLogSetLayout(const char *pattern);
+
+  /**
+   * Adds a field to the context of the calling thread
+   *
+   * Context fields are written on every line of the thread (see the
+   * {ctx} layout field). The context is rendered when it changes, so
+   * writing a line only copies it.
+   *
+   * @param[in] key Field name
+   * @param[in] value Field value
+   * @return false if the context is full
+   */
+  bool vLogContextPush(const char *key, const char *value);
+
+  /**
+   * Removes the last field added to the context of the calling thread
+   */
+  void vLogContextPop(void);
+
+  /**
+   * Removes all the fields from the context of the calling thread
+   */
+  void vLogContextClear(void);
+
+  /**
+   * Sends the log lines to a local collector instead of the log stream
+   *
+   * Lines are queued into a bounded ring and shipped in batches by
+   * a background thread, so callers never wait on the socket. While
+   * the collector is unreachable lines stay in the ring (new lines
+   * are dropped when it's full) and the sender reconnects with an
+   * exponential backoff.
+   *
+   * Unix datagram lines are framed as syslog messages (`<PRI>line`,
+   * compatible with /dev/log and journald), TCP lines are sent
+   * newline-delimited.
+   *
+   * On exit the queued lines are delivered (waiting up to 2 seconds),
+   * so the line of a Fatal is not lost.
+   * In the child of a fork the sink is off (it has no sender thread)
+   * and lines go to the log stream until the sink is started again.
+   *
+   * Like vLogInit, call it before other threads start logging.
+   *
+   * @param[in] type One of LOG_SOCKET_UNIX or LOG_SOCKET_TCP
+   * @param[in] address Socket path (UNIX) or "host:port" (TCP)
+   */
+  bool vLogInitSocket(int type, const char *address);
+
+  /**
+   * Flushes the pending lines, stops the socket sink and
+   * restores the log stream as destination
+   */
+  void vLogCloseSocket(void);
+
+  /**
+   * Writes the log lines to a compressed file instead of the log stream
+   *
+   * Lines are queued into a bounded ring (new lines are dropped when
+   * it's full) and a background thread compresses them into frames of
+   * up to LOG_FRAME_SIZE bytes, written when full or half a second
+   * after their first line. Each frame can be decoded on its own
+   * with vLogReadFrame, so a crash loses at most the last frame.
+   *
+   * Synced lines (see vLogSetDurability) and FATAL lines flush the
+   * frame and wait until it's on disk, periodic lines are synced
+   * within a sync interval. On exit the queued lines are flushed
+   * and synced (waiting up to 2 seconds). Not available when built
+   * with VLOGGER_NO_COMPRESSION (make NO_COMPRESSION=1).
+   *
+   * @param[in] filepath Compressed log file path, lines are appended
+   */
+  bool vLogInitCompressed(const char *filepath);
+
+  /**
+   * Flushes the last frame, stops the compressed sink and
+   * restores the log stream as destination
+   */
+  void vLogCloseCompressed(void);
+
+  /**
+   * Reads and decompresses the next frame of a compressed log file
+   *
+   * @param[in] stream Compressed log file
+   * @param[out] buffer Destination, LOG_FRAME_SIZE bytes are enough
+   * @param[in] size Destination size
+   * A corrupted frame fails with EBADMSG and the stream is moved to
+   * the next frame, so reading can go on; a frame larger than size
+   * fails with ENOBUFS and is left to be read again.
+   *
+   * @return The frame size, 0 at the end of the file or -1 if the
+   *   frame is truncated or corrupted (errno is set)
+   */
+  long vLogReadFrame(FILE *stream, char *buffer, size_t size);
 #endif